@@ -0,0 +1,277 @@
+#include <assert.h>
+#include <complex.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "image.h"
+
+// Columns processed together by the vertical recursive pass.
+#define RECURSIVE_STRIP_W 64
+// Rows per independent strip of the running-sum box filter.
+#define BOX_STRIP_H 64
+
+// Coefficients of the Young-van Vliet recursive Gaussian, normalized by b0.
+// y[n] = B x[n] + b1 y[n-1] + b2 y[n-2] + b3 y[n-3], run forward then back.
+typedef struct {
+  float B, b1, b2, b3;
+} yvv_coefs;
+
+// Poles of the third-order filter for unit scale (van Vliet, Young and
+// Verbeek, 1998). They are scaled as d^(1/q) to reach a given sigma.
+static const double yvv_pole_re = 1.40098, yvv_pole_im = 1.00236;
+static const double yvv_pole_real = 1.85132;
+
+// Variance of the forward-backward filter for poles scaled by 1/q.
+static double yvv_variance(double q) {
+  double complex d = cpow(yvv_pole_re + yvv_pole_im * I, 1 / q);
+  double r = pow(yvv_pole_real, 1 / q);
+  double complex pair = 2 * d / ((d - 1) * (d - 1));
+  return 2 * creal(pair) + 2 * r / ((r - 1) * (r - 1));
+}
+
+static yvv_coefs make_yvv_coefs(float sigma) {
+  // The variance grows with q, so bisect for the q that matches sigma
+  // exactly instead of using the linear fit from the 1995 paper, which
+  // comes out about 10% too wide.
+  double lo = 0.01, hi = 2 * sigma + 10;
+  for (int i = 0; i < 60; i++) {
+    double q = (lo + hi) / 2;
+    if (yvv_variance(q) < sigma * sigma)
+      lo = q;
+    else
+      hi = q;
+  }
+  double q = (lo + hi) / 2;
+  double complex d = cpow(yvv_pole_re + yvv_pole_im * I, 1 / q);
+  double r = pow(yvv_pole_real, 1 / q);
+
+  // Expand (d - z)(conj(d) - z)(r - z) and normalize by its constant term.
+  double mag2 = creal(d * conj(d));
+  double b0 = mag2 * r;
+  yvv_coefs c;
+  c.b1 = (mag2 + 2 * creal(d) * r) / b0;
+  c.b2 = -(2 * creal(d) + r) / b0;
+  c.b3 = 1 / b0;
+  c.B = 1 - (c.b1 + c.b2 + c.b3);
+  return c;
+}
+
+// Number of clamped samples appended past the end of each line so the
+// backward pass starts close to its steady state. The forward pass starts in
+// its exact steady state on the clamped left border and needs no padding.
+static int yvv_padding(float sigma) { return (int)ceilf(4 * sigma); }
+
+// Filter one line in place, forward then backward.
+// float *buf: n samples followed by pad clamped samples.
+static void yvv_line(yvv_coefs c, float *buf, int len) {
+  float p1 = buf[0], p2 = buf[0], p3 = buf[0];
+  for (int i = 0; i < len; i++) {
+    float v = c.B * buf[i] + c.b1 * p1 + c.b2 * p2 + c.b3 * p3;
+    buf[i] = v;
+    p3 = p2;
+    p2 = p1;
+    p1 = v;
+  }
+  p1 = p2 = p3 = buf[len - 1];
+  for (int i = len - 1; i >= 0; i--) {
+    float v = c.B * buf[i] + c.b1 * p1 + c.b2 * p2 + c.b3 * p3;
+    buf[i] = v;
+    p3 = p2;
+    p2 = p1;
+    p1 = v;
+  }
+}
+
+// Filter a strip of columns in place, forward then backward, a whole row of
+// the strip at a time so the inner loop runs along x.
+// float *buf: len rows of sw floats.
+// float *p: scratch, 3 * sw floats.
+static void yvv_strip(yvv_coefs c, float *buf, int len, int sw, float *p) {
+  float *p1 = p, *p2 = p + sw, *p3 = p + 2 * sw;
+  for (int x = 0; x < sw; x++) p1[x] = p2[x] = p3[x] = buf[x];
+  for (int i = 0; i < len; i++) {
+    float *row = buf + i * sw;
+    for (int x = 0; x < sw; x++) {
+      float v = c.B * row[x] + c.b1 * p1[x] + c.b2 * p2[x] + c.b3 * p3[x];
+      row[x] = v;
+      p3[x] = p2[x];
+      p2[x] = p1[x];
+      p1[x] = v;
+    }
+  }
+  float *last = buf + (len - 1) * sw;
+  for (int x = 0; x < sw; x++) p1[x] = p2[x] = p3[x] = last[x];
+  for (int i = len - 1; i >= 0; i--) {
+    float *row = buf + i * sw;
+    for (int x = 0; x < sw; x++) {
+      float v = c.B * row[x] + c.b1 * p1[x] + c.b2 * p2[x] + c.b3 * p3[x];
+      row[x] = v;
+      p3[x] = p2[x];
+      p2[x] = p1[x];
+      p1[x] = v;
+    }
+  }
+}
+
+// Smooth an image with a recursive (IIR) approximation of a Gaussian. Cost
+// per pixel does not depend on sigma. Borders are clamped like get_pixel.
+// image im: image to smooth.
+// float sigma: std dev. of the Gaussian, at least 0.5.
+// returns: smoothed image.
+image recursive_gaussian_image(image im, float sigma) {
+  assert(sigma >= 0.5);
+  yvv_coefs c = make_yvv_coefs(sigma);
+  int pad = yvv_padding(sigma);
+  image result = make_image(im.w, im.h, im.c);
+
+  // Horizontal pass, one row at a time.
+  #pragma omp parallel
+  {
+    float *buf = calloc(im.w + pad, sizeof(float));
+    #pragma omp for
+    for (int r = 0; r < im.h * im.c; r++) {
+      const float *src = im.data + r * im.w;
+      memcpy(buf, src, im.w * sizeof(float));
+      for (int i = im.w; i < im.w + pad; i++) buf[i] = src[im.w - 1];
+      yvv_line(c, buf, im.w + pad);
+      memcpy(result.data + r * im.w, buf, im.w * sizeof(float));
+    }
+    free(buf);
+  }
+
+  // Vertical pass over strips of columns.
+  int strips = (im.w + RECURSIVE_STRIP_W - 1) / RECURSIVE_STRIP_W;
+  #pragma omp parallel
+  {
+    float *buf = calloc((im.h + pad) * RECURSIVE_STRIP_W, sizeof(float));
+    float *p = calloc(3 * RECURSIVE_STRIP_W, sizeof(float));
+    #pragma omp for
+    for (int t = 0; t < strips * im.c; t++) {
+      int x0 = (t % strips) * RECURSIVE_STRIP_W;
+      int sw = MIN(RECURSIVE_STRIP_W, im.w - x0);
+      float *chan = result.data + (t / strips) * im.w * im.h;
+      for (int y = 0; y < im.h + pad; y++) {
+        int sy = MIN(y, im.h - 1);
+        memcpy(buf + y * sw, chan + sy * im.w + x0, sw * sizeof(float));
+      }
+      yvv_strip(c, buf, im.h + pad, sw, p);
+      for (int y = 0; y < im.h; y++) {
+        memcpy(chan + y * im.w + x0, buf + y * sw, sw * sizeof(float));
+      }
+    }
+    free(buf);
+    free(p);
+  }
+  return result;
+}
+
+// Add or subtract one source row from the running column sums.
+// const float *row: source row, or 0 for a constant border row.
+// float sign: 1 to add, -1 to subtract.
+static void box_add_row(float *colsum, const float *row, int w, float value,
+                        float sign) {
+  if (row) {
+    for (int x = 0; x < w; x++) colsum[x] += sign * row[x];
+  } else {
+    for (int x = 0; x < w; x++) colsum[x] += sign * value;
+  }
+}
+
+// Box filter an image with running sums. Each output row keeps a running
+// vertical sum per column and slides a horizontal window over it, so the
+// cost per pixel does not depend on the window size and no integral image
+// or intermediate image is allocated. With BORDER_CLAMP the result matches
+// convolve_image(im, make_box_filter(w), 1) up to float rounding.
+// image im: image to filter.
+// int w: window size.
+// BORDER border: how to extend the image past its edges.
+// float value: pixel value outside the image for BORDER_CONSTANT.
+// returns: filtered image.
+image box_blur_image(image im, int w, BORDER border, float value) {
+  assert(w > 0);
+  int left = (w - 1) / 2, right = w / 2;
+  float scale = 1.0 / (w * w);
+  image result = make_image(im.w, im.h, im.c);
+  int *xi = calloc(im.w + w - 1, sizeof(int));
+  for (int j = 0; j < im.w + w - 1; j++) {
+    xi[j] = border_index(j - left, im.w, border);
+  }
+
+  int strips = (im.h + BOX_STRIP_H - 1) / BOX_STRIP_H;
+  #pragma omp parallel
+  {
+    float *colsum = calloc(im.w, sizeof(float));
+    #pragma omp for
+    for (int t = 0; t < strips * im.c; t++) {
+      int y0 = (t % strips) * BOX_STRIP_H;
+      int y1 = MIN(y0 + BOX_STRIP_H, im.h);
+      const float *src = im.data + (t / strips) * im.w * im.h;
+      float *dst = result.data + (t / strips) * im.w * im.h;
+
+      memset(colsum, 0, im.w * sizeof(float));
+      for (int y = y0 - left; y <= y0 + right; y++) {
+        int sy = border_index(y, im.h, border);
+        box_add_row(colsum, sy < 0 ? 0 : src + sy * im.w, im.w, value, 1);
+      }
+
+      for (int y = y0; y < y1; y++) {
+        if (y > y0) {
+          int in = border_index(y + right, im.h, border);
+          int out = border_index(y - left - 1, im.h, border);
+          box_add_row(colsum, in < 0 ? 0 : src + in * im.w, im.w, value, 1);
+          box_add_row(colsum, out < 0 ? 0 : src + out * im.w, im.w, value,
+                      -1);
+        }
+
+        // A column outside the image sums w constant pixels.
+        float outside = value * w;
+        float sum = 0;
+        for (int j = 0; j < w - 1; j++) {
+          sum += xi[j] < 0 ? outside : colsum[xi[j]];
+        }
+        float *row = dst + y * im.w;
+        for (int x = 0; x < im.w; x++) {
+          int in = xi[x + w - 1];
+          sum += in < 0 ? outside : colsum[in];
+          row[x] = sum * scale;
+          int out = xi[x];
+          sum -= out < 0 ? outside : colsum[out];
+        }
+      }
+    }
+    free(colsum);
+  }
+
+  free(xi);
+  return result;
+}
+
+// Approximate a Gaussian by repeated box filters with clamped borders.
+// Box widths follow Kovesi's choice of two odd sizes whose mix matches the
+// Gaussian's variance.
+// image im: image to smooth.
+// float sigma: std dev. of the Gaussian.
+// int passes: number of box filters to apply, typically 3.
+// returns: smoothed image.
+image iterated_box_image(image im, float sigma, int passes) {
+  assert(passes > 0);
+  float ideal = sqrtf(12 * sigma * sigma / passes + 1);
+  int wl = (int)floorf(ideal);
+  if (wl % 2 == 0) wl--;
+  if (wl < 1) wl = 1;
+  int wu = wl + 2;
+  float m_ideal = (12 * sigma * sigma - passes * wl * wl - 4 * passes * wl -
+                   3 * passes) /
+                  (-4 * wl - 4);
+  int m = (int)roundf(m_ideal);
+
+  image result = copy_image(im);
+  for (int i = 0; i < passes; i++) {
+    image next = box_blur_image(result, i < m ? wl : wu, BORDER_CLAMP, 0);
+    free_image(result);
+    result = next;
+  }
+  return result;
+}
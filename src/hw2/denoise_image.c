@@ -0,0 +1,266 @@
+#include <assert.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "image.h"
+
+// Gray levels of the median filter histograms, split into coarse buckets
+// of MEDIAN_FINE fine bins each.
+#define MEDIAN_BINS 256
+#define MEDIAN_FINE 16
+#define MEDIAN_COARSE (MEDIAN_BINS / MEDIAN_FINE)
+// Rows per independent strip of the median filter.
+#define MEDIAN_STRIP_H 64
+// Cells of padding around the bilateral grid, the reach of its blur.
+#define GRID_PAD 2
+
+// Running histograms of one row of the median filter.
+// uint16_t *fine: w x MEDIAN_BINS column histograms.
+// uint16_t *coarse: w x MEDIAN_COARSE column histograms.
+typedef struct {
+  uint16_t *fine, *coarse;
+} column_hists;
+
+static void add_to_columns(column_hists h, const uint8_t *row, int w,
+                           int sign) {
+  for (int x = 0; x < w; x++) {
+    h.fine[x * MEDIAN_BINS + row[x]] += sign;
+    h.coarse[x * MEDIAN_COARSE + row[x] / MEDIAN_FINE] += sign;
+  }
+}
+
+// Median filter one row from its column histograms, Perreault and Hebert's
+// way: the coarse kernel histogram slides with the window, and each fine
+// bucket is only brought up to date when the median falls into it.
+// const int *ci: column of the window position j is ci[j], clamped.
+static void median_row(column_hists h, const int *ci, int w, int r,
+                       float *out) {
+  uint16_t kc[MEDIAN_COARSE] = {0};
+  uint16_t kf[MEDIAN_BINS];
+  int last[MEDIAN_COARSE];
+  int d = 2 * r + 1;
+  int half = d * d / 2;
+
+  for (int j = 0; j < d; j++) {
+    const uint16_t *c = h.coarse + ci[j] * MEDIAN_COARSE;
+    for (int b = 0; b < MEDIAN_COARSE; b++) kc[b] += c[b];
+  }
+  for (int b = 0; b < MEDIAN_COARSE; b++) last[b] = -d;
+
+  for (int x = 0; x < w; x++) {
+    if (x > 0) {
+      const uint16_t *add = h.coarse + ci[x + 2 * r] * MEDIAN_COARSE;
+      const uint16_t *sub = h.coarse + ci[x - 1] * MEDIAN_COARSE;
+      for (int b = 0; b < MEDIAN_COARSE; b++) kc[b] += add[b] - sub[b];
+    }
+
+    int b = 0, count = 0;
+    while (count + kc[b] <= half) count += kc[b++];
+
+    uint16_t *kb = kf + b * MEDIAN_FINE;
+    if (x - last[b] >= d) {
+      memset(kb, 0, MEDIAN_FINE * sizeof(uint16_t));
+      for (int j = x; j < x + d; j++) {
+        const uint16_t *f = h.fine + ci[j] * MEDIAN_BINS + b * MEDIAN_FINE;
+        for (int i = 0; i < MEDIAN_FINE; i++) kb[i] += f[i];
+      }
+    } else {
+      for (int j = last[b] + 1; j <= x; j++) {
+        const uint16_t *add = h.fine + ci[j + 2 * r] * MEDIAN_BINS;
+        const uint16_t *sub = h.fine + ci[j - 1] * MEDIAN_BINS;
+        add += b * MEDIAN_FINE;
+        sub += b * MEDIAN_FINE;
+        for (int i = 0; i < MEDIAN_FINE; i++) kb[i] += add[i] - sub[i];
+      }
+    }
+    last[b] = x;
+
+    int i = 0;
+    while (count + kb[i] <= half) count += kb[i++];
+    out[x] = (b * MEDIAN_FINE + i) / (float)(MEDIAN_BINS - 1);
+  }
+}
+
+// Median filter an image with a square window and clamped borders. Values
+// are quantised to 256 levels, so the result is the median of the 8-bit
+// image, and the cost per pixel does not depend on the radius.
+// image im: image to filter, values in [0, 1].
+// int r: radius of the window, which is 2r+1 pixels wide.
+// returns: filtered image.
+image median_image(image im, int r) {
+  assert(r >= 0 && r < 128);
+  int d = 2 * r + 1;
+  int size = im.w * im.h;
+  image result = make_image(im.w, im.h, im.c);
+
+  uint8_t *q = calloc(size * im.c, sizeof(uint8_t));
+  for (int i = 0; i < size * im.c; i++) {
+    float v = im.data[i] * (MEDIAN_BINS - 1) + .5;
+    q[i] = v < 0 ? 0 : (v > MEDIAN_BINS - 1 ? MEDIAN_BINS - 1 : (int)v);
+  }
+  int *ci = calloc(im.w + d - 1, sizeof(int));
+  for (int j = 0; j < im.w + d - 1; j++) {
+    ci[j] = border_index(j - r, im.w, BORDER_CLAMP);
+  }
+
+  int strips = (im.h + MEDIAN_STRIP_H - 1) / MEDIAN_STRIP_H;
+  #pragma omp parallel
+  {
+    column_hists h;
+    h.fine = calloc(im.w * MEDIAN_BINS, sizeof(uint16_t));
+    h.coarse = calloc(im.w * MEDIAN_COARSE, sizeof(uint16_t));
+    #pragma omp for schedule(dynamic)
+    for (int t = 0; t < strips * im.c; t++) {
+      int y0 = (t % strips) * MEDIAN_STRIP_H;
+      int y1 = MIN(y0 + MEDIAN_STRIP_H, im.h);
+      const uint8_t *src = q + (t / strips) * size;
+      float *dst = result.data + (t / strips) * size;
+
+      memset(h.fine, 0, im.w * MEDIAN_BINS * sizeof(uint16_t));
+      memset(h.coarse, 0, im.w * MEDIAN_COARSE * sizeof(uint16_t));
+      for (int y = y0 - r; y <= y0 + r; y++) {
+        int sy = border_index(y, im.h, BORDER_CLAMP);
+        add_to_columns(h, src + sy * im.w, im.w, 1);
+      }
+      for (int y = y0; y < y1; y++) {
+        if (y > y0) {
+          int in = border_index(y + r, im.h, BORDER_CLAMP);
+          int out = border_index(y - r - 1, im.h, BORDER_CLAMP);
+          add_to_columns(h, src + in * im.w, im.w, 1);
+          add_to_columns(h, src + out * im.w, im.w, -1);
+        }
+        median_row(h, ci, im.w, r, dst + y * im.w);
+      }
+    }
+    free(h.fine);
+    free(h.coarse);
+  }
+
+  free(q);
+  free(ci);
+  return result;
+}
+
+// Blur the grid along one axis with the binomial kernel [1 4 6 4 1] / 16.
+// Each line has n cells spaced by stride; lines start at the given offsets.
+// float *grid: cells of two floats, weighted value and weight.
+static void blur_grid_axis(float *grid, int n, int stride, const int *starts,
+                           int lines) {
+  #pragma omp parallel
+  {
+    float *line = calloc(2 * n, sizeof(float));
+    #pragma omp for
+    for (int l = 0; l < lines; l++) {
+      float *g = grid + 2 * starts[l];
+      for (int i = 0; i < n; i++) {
+        line[2 * i] = g[2 * i * stride];
+        line[2 * i + 1] = g[2 * i * stride + 1];
+      }
+      for (int i = 0; i < n; i++) {
+        for (int k = 0; k < 2; k++) {
+          float v = 6 * line[2 * i + k];
+          if (i > 0) v += 4 * line[2 * (i - 1) + k];
+          if (i > 1) v += line[2 * (i - 2) + k];
+          if (i + 1 < n) v += 4 * line[2 * (i + 1) + k];
+          if (i + 2 < n) v += line[2 * (i + 2) + k];
+          g[2 * i * stride + k] = v / 16;
+        }
+      }
+    }
+    free(line);
+  }
+}
+
+// Blur a gw x gh x gd grid along all three axes.
+static void blur_grid(float *grid, int gw, int gh, int gd) {
+  int *starts = calloc(MAX(gh * gd, MAX(gw * gd, gw * gh)), sizeof(int));
+  int lines = 0;
+  for (int z = 0; z < gd; z++)
+    for (int y = 0; y < gh; y++) starts[lines++] = (z * gh + y) * gw;
+  blur_grid_axis(grid, gw, 1, starts, lines);
+
+  lines = 0;
+  for (int z = 0; z < gd; z++)
+    for (int x = 0; x < gw; x++) starts[lines++] = z * gh * gw + x;
+  blur_grid_axis(grid, gh, gw, starts, lines);
+
+  lines = 0;
+  for (int y = 0; y < gh; y++)
+    for (int x = 0; x < gw; x++) starts[lines++] = y * gw + x;
+  blur_grid_axis(grid, gd, gw * gh, starts, lines);
+  free(starts);
+}
+
+// Approximate a bilateral filter with a bilateral grid (Paris and Durand).
+// Each channel is splatted into a coarse 3d grid over space and intensity,
+// blurred there, and read back with trilinear interpolation, so the cost
+// per pixel does not depend on sigma_s. Channels are filtered separately,
+// each guided by its own values.
+// image im: image to filter.
+// float sigma_s: spatial std dev. in pixels, also the grid cell size.
+// float sigma_r: range std dev. in intensity, also the grid cell depth.
+// returns: filtered image.
+image bilateral_image(image im, float sigma_s, float sigma_r) {
+  assert(sigma_s > 0 && sigma_r > 0);
+  int size = im.w * im.h;
+  image result = make_image(im.w, im.h, im.c);
+
+  for (int c = 0; c < im.c; c++) {
+    const float *src = im.data + c * size;
+    float *dst = result.data + c * size;
+    float lo = src[0], hi = src[0];
+    for (int i = 1; i < size; i++) {
+      lo = MIN(lo, src[i]);
+      hi = MAX(hi, src[i]);
+    }
+
+    int gw = (int)((im.w - 1) / sigma_s) + 1 + 2 * GRID_PAD;
+    int gh = (int)((im.h - 1) / sigma_s) + 1 + 2 * GRID_PAD;
+    int gd = (int)((hi - lo) / sigma_r) + 1 + 2 * GRID_PAD;
+    float *grid = calloc(2 * gw * gh * gd, sizeof(float));
+
+    for (int y = 0; y < im.h; y++) {
+      int gy = (int)(y / sigma_s + .5) + GRID_PAD;
+      for (int x = 0; x < im.w; x++) {
+        float v = src[y * im.w + x];
+        int gx = (int)(x / sigma_s + .5) + GRID_PAD;
+        int gz = (int)((v - lo) / sigma_r + .5) + GRID_PAD;
+        float *cell = grid + 2 * ((gz * gh + gy) * gw + gx);
+        cell[0] += v;
+        cell[1] += 1;
+      }
+    }
+
+    blur_grid(grid, gw, gh, gd);
+
+    #pragma omp parallel for
+    for (int y = 0; y < im.h; y++) {
+      float fy = y / sigma_s + GRID_PAD;
+      int y0 = (int)fy;
+      float dy = fy - y0;
+      for (int x = 0; x < im.w; x++) {
+        float v = src[y * im.w + x];
+        float fx = x / sigma_s + GRID_PAD;
+        float fz = (v - lo) / sigma_r + GRID_PAD;
+        int x0 = (int)fx, z0 = (int)fz;
+        float dx = fx - x0, dz = fz - z0;
+        float sum[2] = {0, 0};
+        for (int k = 0; k < 8; k++) {
+          int ox = k & 1, oy = (k >> 1) & 1, oz = k >> 2;
+          float wgt = (ox ? dx : 1 - dx) * (oy ? dy : 1 - dy) *
+                      (oz ? dz : 1 - dz);
+          const float *cell =
+              grid + 2 * (((z0 + oz) * gh + y0 + oy) * gw + x0 + ox);
+          sum[0] += wgt * cell[0];
+          sum[1] += wgt * cell[1];
+        }
+        dst[y * im.w + x] = sum[1] > 0 ? sum[0] / sum[1] : v;
+      }
+    }
+    free(grid);
+  }
+  return result;
+}
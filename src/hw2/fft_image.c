@@ -0,0 +1,401 @@
+#include <assert.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "image.h"
+
+// Twiddle factors and bit-reversal permutation for a complex FFT of length n.
+// Also holds the extra twiddles needed to run a real FFT of length 2n on top.
+typedef struct {
+  int n;
+  int *rev;
+  float *cos_table, *sin_table;    // e^{-2 pi i k / n}, k < n/2
+  float *rcos_table, *rsin_table;  // e^{-2 pi i k / 2n}, k <= n/2
+} fft_plan;
+
+// Plan for one axis of a 2d tile: real FFT along x, complex FFT along y.
+typedef struct {
+  int nw, nh;    // tile size, both powers of 2, nw >= 4
+  int bins;      // nw/2 + 1 complex bins per row after the real FFT
+  fft_plan row;  // complex plan of length nw/2
+  fft_plan col;  // complex plan of length nh
+} fft_plan_2d;
+
+static fft_plan make_fft_plan(int n) {
+  fft_plan p;
+  p.n = n;
+  p.rev = calloc(n, sizeof(int));
+  p.cos_table = calloc(n / 2 + 1, sizeof(float));
+  p.sin_table = calloc(n / 2 + 1, sizeof(float));
+  p.rcos_table = calloc(n / 2 + 1, sizeof(float));
+  p.rsin_table = calloc(n / 2 + 1, sizeof(float));
+
+  int bits = 0;
+  while ((1 << bits) < n) bits++;
+  for (int i = 0; i < n; i++) {
+    int r = 0;
+    for (int b = 0; b < bits; b++) {
+      if (i & (1 << b)) r |= 1 << (bits - 1 - b);
+    }
+    p.rev[i] = r;
+  }
+  for (int k = 0; k < n / 2; k++) {
+    p.cos_table[k] = cos(TWOPI * k / n);
+    p.sin_table[k] = -sin(TWOPI * k / n);
+  }
+  for (int k = 0; k <= n / 2; k++) {
+    p.rcos_table[k] = cos(TWOPI * k / (2 * n));
+    p.rsin_table[k] = -sin(TWOPI * k / (2 * n));
+  }
+  return p;
+}
+
+static void free_fft_plan(fft_plan p) {
+  free(p.rev);
+  free(p.cos_table);
+  free(p.sin_table);
+  free(p.rcos_table);
+  free(p.rsin_table);
+}
+
+// In-place iterative radix-2 complex FFT.
+// fft_plan p: plan for the transform length.
+// float *re, *im: real and imaginary parts, p.n values each.
+// int inverse: run the inverse transform (unnormalized).
+static void fft_complex(fft_plan p, float *re, float *im, int inverse) {
+  int n = p.n;
+  for (int i = 0; i < n; i++) {
+    int j = p.rev[i];
+    if (j > i) {
+      float t = re[i];
+      re[i] = re[j];
+      re[j] = t;
+      t = im[i];
+      im[i] = im[j];
+      im[j] = t;
+    }
+  }
+
+  float sign = inverse ? -1 : 1;
+  for (int len = 2; len <= n; len <<= 1) {
+    int half = len / 2;
+    int step = n / len;
+    for (int start = 0; start < n; start += len) {
+      for (int k = 0; k < half; k++) {
+        float wr = p.cos_table[k * step];
+        float wi = sign * p.sin_table[k * step];
+        int a = start + k;
+        int b = a + half;
+        float xr = re[b] * wr - im[b] * wi;
+        float xi = re[b] * wi + im[b] * wr;
+        re[b] = re[a] - xr;
+        im[b] = im[a] - xi;
+        re[a] += xr;
+        im[a] += xi;
+      }
+    }
+  }
+}
+
+// Real FFT of length 2n via a complex FFT of length n.
+// fft_plan p: complex plan of length n.
+// float *x: 2n real samples.
+// float *re, *im: n + 1 output bins (n + 1 floats each, used as scratch).
+static void fft_real(fft_plan p, const float *x, float *re, float *im) {
+  int n = p.n;
+  for (int k = 0; k < n; k++) {
+    re[k] = x[2 * k];
+    im[k] = x[2 * k + 1];
+  }
+  fft_complex(p, re, im, 0);
+  re[n] = re[0];
+  im[n] = im[0];
+
+  // Split the packed spectrum into even/odd parts and recombine. Bins k and
+  // n-k depend on each other so both are computed together.
+  for (int k = 0; k <= n / 2; k++) {
+    int m = n - k;
+    float zr = re[k], zi = im[k];
+    float cr = re[m], ci = -im[m];
+
+    float er = 0.5 * (zr + cr), ei = 0.5 * (zi + ci);
+    float or_ = 0.5 * (zi - ci), oi = -0.5 * (zr - cr);
+    float wr = p.rcos_table[k], wi = p.rsin_table[k];
+    float xr = er + (or_ * wr - oi * wi);
+    float xi = ei + (or_ * wi + oi * wr);
+
+    // Mirror bin: E[m] = conj(E[k]), O[m] = conj(O[k]), W^m = -conj(W^k).
+    float mr = er - (or_ * wr - oi * wi);
+    float mi = -ei + (or_ * wi + oi * wr);
+
+    re[k] = xr;
+    im[k] = xi;
+    re[m] = mr;
+    im[m] = mi;
+  }
+}
+
+// Inverse of fft_real, scaled so that fft_real followed by this is identity.
+// fft_plan p: complex plan of length n.
+// float *re, *im: n + 1 input bins, destroyed.
+// float *x: 2n real output samples.
+static void ifft_real(fft_plan p, float *re, float *im, float *x) {
+  int n = p.n;
+  for (int k = 0; k <= n / 2; k++) {
+    int m = n - k;
+    float ar = re[k], ai = im[k];
+    float br = re[m], bi = -im[m];
+
+    float er = 0.5 * (ar + br), ei = 0.5 * (ai + bi);
+    float dr = 0.5 * (ar - br), di = 0.5 * (ai - bi);
+    // O = D / W^k = D * conj(W^k)
+    float wr = p.rcos_table[k], wi = -p.rsin_table[k];
+    float or_ = dr * wr - di * wi;
+    float oi = dr * wi + di * wr;
+
+    // Z[k] = E + iO, Z[m] = conj(E) + i conj(O)
+    float zr = er - oi, zi = ei + or_;
+    float mr = er + oi, mi = -ei + or_;
+    re[k] = zr;
+    im[k] = zi;
+    re[m] = mr;
+    im[m] = mi;
+  }
+  fft_complex(p, re, im, 1);
+  float scale = 1.0 / n;
+  for (int k = 0; k < n; k++) {
+    x[2 * k] = re[k] * scale;
+    x[2 * k + 1] = im[k] * scale;
+  }
+}
+
+static fft_plan_2d make_fft_plan_2d(int nw, int nh) {
+  fft_plan_2d p;
+  p.nw = nw;
+  p.nh = nh;
+  p.bins = nw / 2 + 1;
+  p.row = make_fft_plan(nw / 2);
+  p.col = make_fft_plan(nh);
+  return p;
+}
+
+static void free_fft_plan_2d(fft_plan_2d p) {
+  free_fft_plan(p.row);
+  free_fft_plan(p.col);
+}
+
+// Forward 2d FFT of a real nh x nw tile.
+// float *tile: nh * nw real samples, row-major.
+// float *re, *im: nh * bins spectrum, row-major.
+// float *cr, *ci: scratch columns of nh values each.
+static void fft_2d(fft_plan_2d p, const float *tile, float *re, float *im,
+                   float *cr, float *ci) {
+  for (int y = 0; y < p.nh; y++) {
+    fft_real(p.row, tile + y * p.nw, re + y * p.bins, im + y * p.bins);
+  }
+  for (int x = 0; x < p.bins; x++) {
+    for (int y = 0; y < p.nh; y++) {
+      cr[y] = re[y * p.bins + x];
+      ci[y] = im[y * p.bins + x];
+    }
+    fft_complex(p.col, cr, ci, 0);
+    for (int y = 0; y < p.nh; y++) {
+      re[y * p.bins + x] = cr[y];
+      im[y * p.bins + x] = ci[y];
+    }
+  }
+}
+
+// Inverse of fft_2d. The spectrum is destroyed.
+static void ifft_2d(fft_plan_2d p, float *re, float *im, float *tile,
+                    float *cr, float *ci) {
+  float scale = 1.0 / p.nh;
+  for (int x = 0; x < p.bins; x++) {
+    for (int y = 0; y < p.nh; y++) {
+      cr[y] = re[y * p.bins + x];
+      ci[y] = im[y * p.bins + x];
+    }
+    fft_complex(p.col, cr, ci, 1);
+    for (int y = 0; y < p.nh; y++) {
+      re[y * p.bins + x] = cr[y] * scale;
+      im[y * p.bins + x] = ci[y] * scale;
+    }
+  }
+  for (int y = 0; y < p.nh; y++) {
+    ifft_real(p.row, re + y * p.bins, im + y * p.bins, tile + y * p.nw);
+  }
+}
+
+// Pick an FFT length for one axis of the overlap-add tiling.
+// int k: kernel extent along the axis.
+// int extent: extent of the (virtually padded) signal along the axis.
+// returns: power of 2 at least k, large enough that most of each tile is
+//          new data, but no larger than needed to cover the whole signal.
+static int fft_tile_size(int k, int extent) {
+  int n = 16;
+  while (n < 4 * (k - 1)) n <<= 1;
+  int limit = 1;
+  while (limit < extent + k - 1) limit <<= 1;
+  if (n > limit) n = limit;
+  if (n < 4) n = 4;
+  return n;
+}
+
+// Copy a block of one channel into the top-left of an FFT tile, reading
+// pixels outside the image according to the border mode.
+// image im: source image.
+// int c: channel to read.
+// float *tile: destination tile with row stride nw.
+// int x0, y0: image coordinates of the block's top-left, may be outside im.
+// int tw, th: block size.
+// BORDER border, float value: border mode and constant border value.
+// int accumulate: add to the tile instead of overwriting it.
+static void load_tile(image im, int c, float *tile, int nw, int x0, int y0,
+                      int tw, int th, BORDER border, float value,
+                      int accumulate) {
+  float *src = im.data + c * im.w * im.h;
+  for (int y = 0; y < th; y++) {
+    int sy = border_index(y0 + y, im.h, border);
+    float *row = sy < 0 ? 0 : src + sy * im.w;
+    float *dst = tile + y * nw;
+    for (int x = 0; x < tw; x++) {
+      int sx = border_index(x0 + x, im.w, border);
+      float v = (sx < 0 || sy < 0) ? value : row[sx];
+      if (accumulate)
+        dst[x] += v;
+      else
+        dst[x] = v;
+    }
+  }
+}
+
+// Convolve an image with a filter using FFTs and overlap-add tiling. Borders
+// are handled exactly as in convolve_image_border, and the result matches it
+// up to float rounding, but the cost per pixel does not depend on the filter
+// size.
+// image im: image to convolve.
+// image filter: filter, with 1 channel or as many channels as im.
+// int preserve: keep all channels (1) or sum them into one (0).
+// BORDER border: how to extend the image past its edges.
+// float value: pixel value outside the image for BORDER_CONSTANT.
+// returns: convolved image.
+image fft_convolve_image_border(image im, image filter, int preserve,
+                                BORDER border, float value) {
+  assert(im.c == filter.c || filter.c == 1);
+
+  int kw = filter.w, kh = filter.h;
+  int pw = (kw - 1) / 2, ph = (kh - 1) / 2;
+  // The image extended out to the full footprint of the filter.
+  int ew = im.w + kw - 1, eh = im.h + kh - 1;
+
+  fft_plan_2d p = make_fft_plan_2d(fft_tile_size(kw, ew),
+                                   fft_tile_size(kh, eh));
+  int lw = p.nw - kw + 1, lh = p.nh - kh + 1;
+  int spectrum = p.nh * p.bins;
+
+  // convolve_image correlates, so the filter is flipped before transforming.
+  float *kr = calloc(spectrum * filter.c, sizeof(float));
+  float *ki = calloc(spectrum * filter.c, sizeof(float));
+  {
+    float *tile = calloc(p.nw * p.nh, sizeof(float));
+    float *cr = calloc(p.nh, sizeof(float));
+    float *ci = calloc(p.nh, sizeof(float));
+    for (int c = 0; c < filter.c; c++) {
+      memset(tile, 0, p.nw * p.nh * sizeof(float));
+      for (int y = 0; y < kh; y++) {
+        for (int x = 0; x < kw; x++) {
+          tile[y * p.nw + x] =
+              filter.data[c * kw * kh + (kh - 1 - y) * kw + (kw - 1 - x)];
+        }
+      }
+      fft_2d(p, tile, kr + c * spectrum, ki + c * spectrum, cr, ci);
+    }
+    free(tile);
+    free(cr);
+    free(ci);
+  }
+
+  image result = make_image(im.w, im.h, preserve ? im.c : 1);
+  // With one filter channel and no preserve, summing channels commutes with
+  // the convolution, so the channels are summed before transforming.
+  int fold = !preserve && filter.c == 1;
+  int tiles_x = (ew + lw - 1) / lw, tiles_y = (eh + lh - 1) / lh;
+
+  // A tile adds into kw-1 (kh-1) pixels past its own block, which is less
+  // than one block, so tiles two apart never touch. Running the four
+  // parities of (tile x, tile y) one after another keeps each phase free of
+  // races when built with OPENMP=1.
+  for (int phase = 0; phase < 4; phase++) {
+    #pragma omp parallel
+    {
+      float *tile = calloc(p.nw * p.nh, sizeof(float));
+      float *re = calloc(spectrum, sizeof(float));
+      float *ri = calloc(spectrum, sizeof(float));
+      float *acc_r = calloc(spectrum, sizeof(float));
+      float *acc_i = calloc(spectrum, sizeof(float));
+      float *cr = calloc(p.nh, sizeof(float));
+      float *ci = calloc(p.nh, sizeof(float));
+
+      #pragma omp for schedule(dynamic)
+      for (int t = 0; t < tiles_x * tiles_y; t++) {
+        int bx = t % tiles_x, by = t / tiles_x;
+        if ((bx & 1) != (phase & 1) || (by & 1) != (phase >> 1)) continue;
+        int tx = bx * lw, ty = by * lh;
+        int th = MIN(lh, eh - ty), tw = MIN(lw, ew - tx);
+
+        for (int c = 0; c < im.c; c++) {
+          int fc = filter.c == 1 ? 0 : c;
+          int last = c == im.c - 1;
+          load_tile(im, c, tile, p.nw, tx - pw, ty - ph, tw, th, border,
+                    value, fold);
+          if (fold && !last) continue;
+
+          fft_2d(p, tile, re, ri, cr, ci);
+
+          float *fr = kr + fc * spectrum, *fi = ki + fc * spectrum;
+          for (int i = 0; i < spectrum; i++) {
+            acc_r[i] += re[i] * fr[i] - ri[i] * fi[i];
+            acc_i[i] += re[i] * fi[i] + ri[i] * fr[i];
+          }
+          if (!preserve && !last) continue;
+
+          ifft_2d(p, acc_r, acc_i, tile, cr, ci);
+          // Tile sample (u, v) is full-convolution sample (tx+u, ty+v),
+          // which is output pixel (tx+u-(kw-1), ty+v-(kh-1)).
+          float *dst = result.data + (preserve ? c : 0) * im.w * im.h;
+          for (int v = 0; v < p.nh; v++) {
+            int y = ty + v - (kh - 1);
+            if (y < 0 || y >= im.h) continue;
+            for (int u = 0; u < p.nw; u++) {
+              int x = tx + u - (kw - 1);
+              if (x < 0 || x >= im.w) continue;
+              dst[y * im.w + x] += tile[v * p.nw + u];
+            }
+          }
+          memset(tile, 0, p.nw * p.nh * sizeof(float));
+          memset(acc_r, 0, spectrum * sizeof(float));
+          memset(acc_i, 0, spectrum * sizeof(float));
+        }
+      }
+
+      free(tile);
+      free(re);
+      free(ri);
+      free(acc_r);
+      free(acc_i);
+      free(cr);
+      free(ci);
+    }
+  }
+
+  free(kr);
+  free(ki);
+  free_fft_plan_2d(p);
+  return result;
+}
+
+image fft_convolve_image(image im, image filter, int preserve) {
+  return fft_convolve_image_border(im, filter, preserve, BORDER_CLAMP, 0);
+}
@@ -0,0 +1,145 @@
+#include <assert.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "image.h"
+
+// Largest filter the fixed-point path handles, in taps per side.
+#define FIXED_MAX_K 15
+// Largest tap magnitude, so that tap * 255 fits in an int16 lane.
+#define FIXED_MAX_TAP 128
+
+image_u8 make_image_u8(int w, int h, int c) {
+  image_u8 out;
+  out.w = w;
+  out.h = h;
+  out.c = c;
+  out.data = calloc(w * h * c, sizeof(uint8_t));
+  return out;
+}
+
+void free_image_u8(image_u8 im) { free(im.data); }
+
+// Convert an image to 8 bits, rounding and saturating to [0, 255].
+image_u8 image_to_u8(image im) {
+  image_u8 out = make_image_u8(im.w, im.h, im.c);
+  for (int i = 0; i < im.w * im.h * im.c; i++) {
+    float v = im.data[i] * 255 + .5;
+    out.data[i] = v < 0 ? 0 : (v > 255 ? 255 : (int)v);
+  }
+  return out;
+}
+
+// Convert an 8-bit image back to floats in [0, 1].
+image u8_to_image(image_u8 im) {
+  image out = make_image(im.w, im.h, im.c);
+  for (int i = 0; i < im.w * im.h * im.c; i++) {
+    out.data[i] = im.data[i] / 255.0;
+  }
+  return out;
+}
+
+static inline int16_t adds16(int a, int b) {
+  int s = a + b;
+  return s < INT16_MIN ? INT16_MIN : (s > INT16_MAX ? INT16_MAX : s);
+}
+
+// Scalar version of one output pixel, saturating exactly like the SIMD lanes.
+static inline uint8_t fixed_pixel(const uint8_t **rows, const int *xi, int x,
+                                  const int16_t *taps, int kw, int kh,
+                                  int shift, int offset) {
+  int16_t acc = shift ? 1 << (shift - 1) : 0;
+  for (int j = 0; j < kh; j++) {
+    for (int i = 0; i < kw; i++) {
+      acc = adds16(acc, (int16_t)(taps[j * kw + i] * rows[j][xi[x + i]]));
+    }
+  }
+  int v = adds16(acc >> shift, offset);
+  return v < 0 ? 0 : (v > 255 ? 255 : v);
+}
+
+// Convolve an 8-bit image in 16-bit fixed point. Taps are rounded to
+// filter * 2^shift and the sum is scaled back by 2^-shift with rounding, so
+// integer filters like make_gx_filter are exact with shift 0 and fractional
+// ones like make_box_filter are approximated to shift bits. Products and
+// sums saturate in int16, which never happens while the sum of absolute
+// taps times 255 stays below 32768. Eight pixels are processed per SSE2
+// instruction, with a scalar path for the borders, which are clamped.
+// image_u8 im: image to convolve, each channel separately.
+// image filter: single-channel filter, at most FIXED_MAX_K taps per side.
+// int shift: fractional bits of the taps.
+// int offset: added to the scaled sum before saturating to [0, 255], e.g.
+//             128 to keep the sign of gradient filters.
+// returns: convolved image.
+image_u8 convolve_image_u8(image_u8 im, image filter, int shift, int offset) {
+  assert(filter.c == 1);
+  assert(filter.w <= FIXED_MAX_K && filter.h <= FIXED_MAX_K);
+  assert(shift >= 0 && shift < 15);
+  int kw = filter.w, kh = filter.h;
+  int pw = (kw - 1) / 2, ph = (kh - 1) / 2;
+  int16_t taps[FIXED_MAX_K * FIXED_MAX_K];
+  for (int i = 0; i < kw * kh; i++) {
+    float t = roundf(filter.data[i] * (1 << shift));
+    assert(fabsf(t) <= FIXED_MAX_TAP);
+    taps[i] = t;
+  }
+
+  image_u8 result = make_image_u8(im.w, im.h, im.c);
+  int *xi = calloc(im.w + kw - 1, sizeof(int));
+  for (int j = 0; j < im.w + kw - 1; j++) {
+    xi[j] = border_index(j - pw, im.w, BORDER_CLAMP);
+  }
+  // Output columns whose taps all land inside the image.
+  int x_lo = MIN(pw, im.w);
+  int x_hi = MAX(im.w - kw + pw + 1, x_lo);
+
+  #pragma omp parallel for
+  for (int t = 0; t < im.h * im.c; t++) {
+    int c = t / im.h, y = t % im.h;
+    const uint8_t *src = im.data + c * im.w * im.h;
+    uint8_t *dst = result.data + c * im.w * im.h + y * im.w;
+    const uint8_t *rows[FIXED_MAX_K];
+    for (int j = 0; j < kh; j++) {
+      rows[j] = src + border_index(y - ph + j, im.h, BORDER_CLAMP) * im.w;
+    }
+
+    int x = x_lo;
+#ifdef __SSE2__
+    __m128i zero = _mm_setzero_si128();
+    __m128i bias = _mm_set1_epi16(shift ? 1 << (shift - 1) : 0);
+    __m128i off = _mm_set1_epi16(offset);
+    for (; x + 8 <= x_hi; x += 8) {
+      __m128i acc = bias;
+      for (int j = 0; j < kh; j++) {
+        const uint8_t *r = rows[j] + x - pw;
+        for (int i = 0; i < kw; i++) {
+          __m128i px = _mm_loadl_epi64((const __m128i *)(r + i));
+          px = _mm_unpacklo_epi8(px, zero);
+          __m128i k = _mm_set1_epi16(taps[j * kw + i]);
+          acc = _mm_adds_epi16(acc, _mm_mullo_epi16(px, k));
+        }
+      }
+      acc = _mm_adds_epi16(_mm_srai_epi16(acc, shift), off);
+      _mm_storel_epi64((__m128i *)(dst + x), _mm_packus_epi16(acc, acc));
+    }
+#endif
+    for (; x < x_hi; x++) {
+      dst[x] = fixed_pixel(rows, xi, x, taps, kw, kh, shift, offset);
+    }
+    for (x = 0; x < x_lo; x++) {
+      dst[x] = fixed_pixel(rows, xi, x, taps, kw, kh, shift, offset);
+    }
+    for (x = x_hi; x < im.w; x++) {
+      dst[x] = fixed_pixel(rows, xi, x, taps, kw, kh, shift, offset);
+    }
+  }
+
+  free(xi);
+  return result;
+}
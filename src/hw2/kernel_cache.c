@@ -0,0 +1,117 @@
+#include <assert.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "image.h"
+
+// Kernels are shared for sigmas on a grid of KERNEL_STEPS per unit up to
+// KERNEL_MAX_SIGMA, one slot per sigma and shape, so the cache has a fixed
+// size however many different sigmas are asked for.
+#define KERNEL_STEPS 8
+#define KERNEL_MAX_SIGMA 16
+#define KERNEL_SLOTS (KERNEL_STEPS * KERNEL_MAX_SIGMA + 1)
+
+// Normalized 1d Gaussians for the sigmas the library uses most, so they
+// never have to be built at run time: 1, 2 for Harris, structure matrices,
+// BRIEF and optical flow smoothing, 3 and 4 for the larger blurs of the
+// exercises and the recursive-filter switch. The values are those of
+// make_1d_gaussian rounded to float literals; they match it to within
+// rounding, not necessarily bit for bit.
+static float gaussian_1[7] = {
+    0.00443304842, 0.0540055893, 0.242036253, 0.399050295,
+    0.242036253,   0.0540055893, 0.00443304842};
+static float gaussian_2[13] = {
+    0.00221819594, 0.00877313502, 0.027023159, 0.0648251846, 0.121109389,
+    0.176213115,   0.19967562,    0.176213115, 0.121109389,  0.0648251846,
+    0.027023159,   0.00877313502, 0.00221819594};
+static float gaussian_3[19] = {
+    0.00147945166, 0.00380423898, 0.00875346176, 0.0180234108, 0.0332077257,
+    0.0547502898,  0.0807753205,  0.106638998,   0.125979096,  0.133175999,
+    0.125979096,   0.106638998,   0.0807753205,  0.0547502898, 0.0332077257,
+    0.0180234108,  0.00875346176, 0.00380423898, 0.00147945166};
+static float gaussian_4[25] = {
+    0.00110988179, 0.00227732956, 0.00438966742, 0.00794866122, 0.0135211283,
+    0.0216067005,  0.0324354991,  0.0457413867,  0.0605974905,  0.0754147992,
+    0.0881688297,  0.096834518,   0.0999083668,  0.096834518,   0.0881688297,
+    0.0754147992,  0.0605974905,  0.0457413867,  0.0324354991,  0.0216067005,
+    0.0135211283,  0.00794866122, 0.00438966742, 0.00227732956, 0.00110988179};
+
+// slots[1] holds 1d kernels and slots[0] 2d ones, indexed by sigma *
+// KERNEL_STEPS. The tables above are in place from the start.
+static image slots[2][KERNEL_SLOTS] = {
+    [1][1 * KERNEL_STEPS] = {7, 1, 1, gaussian_1},
+    [1][2 * KERNEL_STEPS] = {13, 1, 1, gaussian_2},
+    [1][3 * KERNEL_STEPS] = {19, 1, 1, gaussian_3},
+    [1][4 * KERNEL_STEPS] = {25, 1, 1, gaussian_4},
+};
+// Set once a slot's kernel is complete; read without the lock.
+static int ready[2][KERNEL_SLOTS] = {
+    [1][1 * KERNEL_STEPS] = 1,
+    [1][2 * KERNEL_STEPS] = 1,
+    [1][3 * KERNEL_STEPS] = 1,
+    [1][4 * KERNEL_STEPS] = 1,
+};
+static pthread_mutex_t build_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Slot of a sigma, or -1 if it is not on the grid. The range is checked
+// before the cast, so NaN and huge sigmas are simply off the grid.
+static int kernel_slot(float sigma) {
+  float q = sigma * KERNEL_STEPS;
+  if (!(q >= 1 && q < KERNEL_SLOTS)) return -1;
+  int i = (int)q;
+  return q == i ? i : -1;
+}
+
+static image build_kernel(float sigma, int separable) {
+  return separable ? make_1d_gaussian(sigma) : make_gaussian_filter(sigma);
+}
+
+// Get a Gaussian kernel. Sigmas on a grid of 1/8 up to 16, which covers
+// the ones the library uses, are built once and shared; lookups of a
+// built kernel take no lock, so many threads can ask at once. Other sigmas
+// get a fresh kernel, so the cache never grows past one kernel per grid
+// point and shape. Hand the kernel back with release_gaussian_kernel.
+// float sigma: std dev. of the Gaussian.
+// int separable: 1 for the 1d kernel of make_1d_gaussian, as a w x 1 row,
+//                0 for the 2d kernel of make_gaussian_filter.
+// returns: the kernel, which the caller must not modify.
+image gaussian_kernel(float sigma, int separable) {
+  separable = separable != 0;
+  int i = kernel_slot(sigma);
+  if (i < 0) return build_kernel(sigma, separable);
+  if (__atomic_load_n(&ready[separable][i], __ATOMIC_ACQUIRE)) {
+    return slots[separable][i];
+  }
+
+  pthread_mutex_lock(&build_lock);
+  if (!ready[separable][i]) {
+    image k;
+    if (!separable && ready[1][i]) {
+      // Outer product of the 1d kernel, so tabled sigmas stay consistent.
+      image g = slots[1][i];
+      k = make_image(g.w, g.w, 1);
+      for (int y = 0; y < g.w; y++) {
+        for (int x = 0; x < g.w; x++) {
+          k.data[y * g.w + x] = g.data[y] * g.data[x];
+        }
+      }
+    } else {
+      k = build_kernel(sigma, separable);
+    }
+    slots[separable][i] = k;
+    __atomic_store_n(&ready[separable][i], 1, __ATOMIC_RELEASE);
+  }
+  pthread_mutex_unlock(&build_lock);
+  return slots[separable][i];
+}
+
+// Hand back a kernel from gaussian_kernel. Shared kernels stay cached; the
+// fresh ones made for sigmas off the grid are freed.
+// float sigma: the sigma it was asked for with.
+// image k: the kernel.
+void release_gaussian_kernel(float sigma, image k) {
+  if (kernel_slot(sigma) < 0) free_image(k);
+}
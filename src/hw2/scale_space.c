@@ -0,0 +1,84 @@
+#include <assert.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "image.h"
+
+// Build a stack of increasingly blurred copies of an image. Each level is
+// blurred from the one before it by the residual sigma, sqrt(s1^2 - s0^2),
+// instead of from the original, so the total cost grows with the residual
+// blurs rather than the full sigmas.
+// image im: image to blur.
+// const float *sigmas: n increasing std devs., 0 for an unblurred copy.
+// int n: number of levels.
+// returns: scale space with levels[i] blurred by sigmas[i].
+scale_space make_scale_space(image im, const float *sigmas, int n) {
+  assert(n > 0);
+  scale_space s;
+  s.n = n;
+  s.sigmas = calloc(n, sizeof(float));
+  s.levels = calloc(n, sizeof(image));
+  memcpy(s.sigmas, sigmas, n * sizeof(float));
+
+  image prev = im;
+  float prev_sigma = 0;
+  for (int i = 0; i < n; i++) {
+    assert(sigmas[i] >= prev_sigma);
+    float residual = sqrtf(sigmas[i] * sigmas[i] - prev_sigma * prev_sigma);
+    s.levels[i] = residual > 0 ? smooth_image(prev, residual)
+                               : copy_image(prev);
+    prev = s.levels[i];
+    prev_sigma = sigmas[i];
+  }
+  return s;
+}
+
+// Build a scale space whose sigmas grow geometrically, as used for blob
+// detection: sigma0, sigma0 * k, sigma0 * k^2, ...
+// image im: image to blur.
+// float sigma0: blur of the first level.
+// float k: ratio between the blurs of neighbouring levels, above 1.
+// int n: number of levels.
+// returns: scale space with n levels.
+scale_space make_geometric_scale_space(image im, float sigma0, float k, int n) {
+  assert(k > 1);
+  float *sigmas = calloc(n, sizeof(float));
+  for (int i = 0; i < n; i++) sigmas[i] = sigma0 * powf(k, i);
+  scale_space s = make_scale_space(im, sigmas, n);
+  free(sigmas);
+  return s;
+}
+
+void free_scale_space(scale_space s) {
+  for (int i = 0; i < s.n; i++) free_image(s.levels[i]);
+  free(s.levels);
+  free(s.sigmas);
+}
+
+// Difference of Gaussians between two neighbouring levels, a band-pass
+// image that approximates a scale-normalised Laplacian of Gaussian.
+// scale_space s: scale space to read.
+// int i: level, the result is levels[i+1] - levels[i].
+// returns: difference image.
+image dog_image(scale_space s, int i) {
+  assert(i >= 0 && i + 1 < s.n);
+  return sub_image(s.levels[i + 1], s.levels[i]);
+}
+
+// Split an image into low and high frequencies with one blur, shared by
+// both bands: the high band is the image minus that blur, rather than a
+// second blur subtracted from it.
+// image im: image to split.
+// float sigma: std dev. of the Gaussian that separates the bands.
+// image *low: set to the blurred image.
+// image *high: set to im - *low.
+void frequency_split(image im, float sigma, image *low, image *high) {
+  *low = smooth_image(im, sigma);
+  *high = make_image(im.w, im.h, im.c);
+  int size = im.w * im.h * im.c;
+  for (int i = 0; i < size; i++) {
+    high->data[i] = im.data[i] - low->data[i];
+  }
+}
@@ -0,0 +1,133 @@
+#include <assert.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "image.h"
+
+// Coefficients of the named filters, row-major. These are compile-time
+// constants so each stencil below is specialised for its own taps.
+static const float highpass_taps[9] = {0, -1, 0, -1, 4, -1, 0, -1, 0};
+static const float sharpen_taps[9] = {0, -1, 0, -1, 5, -1, 0, -1, 0};
+static const float emboss_taps[9] = {-2, -1, 0, -1, 1, 1, 0, 1, 2};
+static const float gx_taps[9] = {-1, 0, 1, -2, 0, 2, -1, 0, 1};
+static const float gy_taps[9] = {-1, -2, -1, 0, 0, 0, 1, 2, 1};
+static const float binomial5_taps[25] = {
+    1 / 256.0,  4 / 256.0,  6 / 256.0,  4 / 256.0,  1 / 256.0,
+    4 / 256.0,  16 / 256.0, 24 / 256.0, 16 / 256.0, 4 / 256.0,
+    6 / 256.0,  24 / 256.0, 36 / 256.0, 24 / 256.0, 6 / 256.0,
+    4 / 256.0,  16 / 256.0, 24 / 256.0, 16 / 256.0, 4 / 256.0,
+    1 / 256.0,  4 / 256.0,  6 / 256.0,  4 / 256.0,  1 / 256.0};
+static const float laplacian5_taps[25] = {
+    0,  0,  -1, 0,  0,
+    0,  -1, -2, -1, 0,
+    -1, -2, 16, -2, -1,
+    0,  -1, -2, -1, 0,
+    0,  0,  -1, 0,  0};
+
+// Compute one output row of an n x n stencil on one channel with clamped
+// borders. Always inlined into the per-filter wrappers below so that n and
+// the taps are constants: the tap loops unroll, zero taps drop out, and the
+// interior loop vectorises along x.
+// const float *k: n * n taps.
+// int y: output row.
+// float *out: output row.
+// int accumulate: add to out instead of overwriting it.
+static inline __attribute__((always_inline)) void stencil_row(
+    const float *k, int n, image im, int c, int y, float *out,
+    int accumulate) {
+  int r = n / 2;
+  const float *src = im.data + c * im.w * im.h;
+  const float *rows[5];
+  for (int j = 0; j < n; j++) {
+    int sy = y - r + j;
+    sy = sy < 0 ? 0 : (sy >= im.h ? im.h - 1 : sy);
+    rows[j] = src + sy * im.w;
+  }
+
+  int x_lo = MIN(r, im.w), x_hi = MAX(im.w - r, x_lo);
+  for (int x = x_lo; x < x_hi; x++) {
+    float sum = 0;
+    for (int j = 0; j < n; j++) {
+      for (int i = 0; i < n; i++) sum += k[j * n + i] * rows[j][x - r + i];
+    }
+    out[x] = accumulate ? out[x] + sum : sum;
+  }
+
+  for (int x = 0; x < im.w; x++) {
+    if (x == x_lo) x = x_hi;
+    if (x >= im.w) break;
+    float sum = 0;
+    for (int j = 0; j < n; j++) {
+      for (int i = 0; i < n; i++) {
+        int sx = x - r + i;
+        sx = sx < 0 ? 0 : (sx >= im.w ? im.w - 1 : sx);
+        sum += k[j * n + i] * rows[j][sx];
+      }
+    }
+    out[x] = accumulate ? out[x] + sum : sum;
+  }
+}
+
+typedef void (*stencil_fn)(image im, int c, int y, float *out,
+                           int accumulate);
+
+#define DEFINE_STENCIL(name, n)                                          \
+  static void name##_stencil(image im, int c, int y, float *out,         \
+                             int accumulate) {                           \
+    stencil_row(name##_taps, n, im, c, y, out, accumulate);              \
+  }
+
+DEFINE_STENCIL(highpass, 3)
+DEFINE_STENCIL(sharpen, 3)
+DEFINE_STENCIL(emboss, 3)
+DEFINE_STENCIL(gx, 3)
+DEFINE_STENCIL(gy, 3)
+DEFINE_STENCIL(binomial5, 5)
+DEFINE_STENCIL(laplacian5, 5)
+
+// Indexed by FILTER.
+static const struct {
+  int n;
+  const float *taps;
+  stencil_fn row;
+} named_filters[] = {
+    {3, highpass_taps, highpass_stencil},
+    {3, sharpen_taps, sharpen_stencil},
+    {3, emboss_taps, emboss_stencil},
+    {3, gx_taps, gx_stencil},
+    {3, gy_taps, gy_stencil},
+    {5, binomial5_taps, binomial5_stencil},
+    {5, laplacian5_taps, laplacian5_stencil},
+};
+
+// Make the filter image for a named filter, for use with convolve_image.
+// FILTER f: which filter.
+// returns: n x n single-channel filter.
+image make_named_filter(FILTER f) {
+  int n = named_filters[f].n;
+  image filter = make_image(n, n, 1);
+  memcpy(filter.data, named_filters[f].taps, n * n * sizeof(float));
+  return filter;
+}
+
+// Convolve an image with a named filter using its specialised stencil.
+// Same result as convolve_image with make_named_filter(f).
+// image im: image to convolve.
+// FILTER f: which filter.
+// int preserve: keep all channels (1) or sum them into one (0).
+// returns: convolved image.
+image named_filter_image(image im, FILTER f, int preserve) {
+  stencil_fn row = named_filters[f].row;
+  image result = make_image(im.w, im.h, preserve ? im.c : 1);
+
+  #pragma omp parallel for
+  for (int y = 0; y < im.h; y++) {
+    for (int c = 0; c < im.c; c++) {
+      float *out = result.data + (preserve ? c : 0) * im.w * im.h + y * im.w;
+      row(im, c, y, out, !preserve && c > 0);
+    }
+  }
+  return result;
+}
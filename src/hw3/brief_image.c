@@ -0,0 +1,176 @@
+#include <assert.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "image.h"
+
+// Side of the square patch the tests are drawn from, and its half width.
+#define BRIEF_PATCH 31
+#define BRIEF_RADIUS (BRIEF_PATCH / 2)
+#define BRIEF_BITS (64 * BRIEF_WORDS)
+// Std dev. of the smoothing applied before sampling, at scale 1.
+#define BRIEF_SIGMA 2
+// Seed of the sampling pattern. Changing it invalidates stored descriptors.
+#define BRIEF_SEED 0x9e3779b9u
+
+// Offsets of the two pixels compared by each test: x0, y0, x1, y1.
+static int8_t pattern[BRIEF_BITS][4];
+static pthread_once_t pattern_once = PTHREAD_ONCE_INIT;
+
+static uint32_t xorshift32(uint32_t *s) {
+  uint32_t x = *s;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  return *s = x;
+}
+
+// One sample of an isotropic Gaussian with std dev. BRIEF_PATCH / 5, as in
+// Calonder et al.'s G II pattern, rounded and clamped to the patch.
+static int8_t pattern_offset(uint32_t *s) {
+  float u1 = (xorshift32(s) + 1.0f) / 4294967296.0f;
+  float u2 = xorshift32(s) / 4294967296.0f;
+  float g = sqrtf(-2 * logf(u1)) * cosf(TWOPI * u2) * BRIEF_PATCH / 5;
+  int v = (int)roundf(g);
+  return v < -BRIEF_RADIUS ? -BRIEF_RADIUS
+                           : (v > BRIEF_RADIUS ? BRIEF_RADIUS : v);
+}
+
+// Build the sampling pattern. It depends only on BRIEF_SEED, so every run
+// and every image uses the same tests.
+static void make_pattern() {
+  uint32_t s = BRIEF_SEED;
+  for (int i = 0; i < BRIEF_BITS; i++) {
+    for (int k = 0; k < 4; k++) pattern[i][k] = pattern_offset(&s);
+  }
+}
+
+static inline float brief_scale(descriptor d) {
+  return d.scale > 0 ? d.scale : 1;
+}
+
+// Run the tests of one point on an image smoothed for its scale.
+static void brief_point(image s, descriptor d, binary_descriptor *b) {
+  float scale = brief_scale(d);
+  int x = (int)roundf(d.p.x), y = (int)roundf(d.p.y);
+  int r = (int)ceilf(BRIEF_RADIUS * scale);
+  int inside = x >= r && y >= r && x < s.w - r && y < s.h - r;
+  b->p = d.p;
+  b->scale = d.scale;
+  for (int k = 0; k < BRIEF_BITS; k++) {
+    int x0 = x + (int)roundf(pattern[k][0] * scale);
+    int y0 = y + (int)roundf(pattern[k][1] * scale);
+    int x1 = x + (int)roundf(pattern[k][2] * scale);
+    int y1 = y + (int)roundf(pattern[k][3] * scale);
+    if (!inside) {
+      x0 = MIN(MAX(x0, 0), s.w - 1);
+      y0 = MIN(MAX(y0, 0), s.h - 1);
+      x1 = MIN(MAX(x1, 0), s.w - 1);
+      y1 = MIN(MAX(y1, 0), s.h - 1);
+    }
+    uint64_t bit = s.data[y0 * s.w + x0] < s.data[y1 * s.w + x1];
+    b->bits[k / 64] |= bit << (k % 64);
+  }
+}
+
+// Compute 256-bit BRIEF descriptors (Calonder et al.) for a set of points.
+// Each bit compares two pixels of a Gaussian-smoothed grayscale image at
+// fixed offsets around the point, so a descriptor is 32 bytes instead of
+// 25 * C floats and is compared with popcount instead of float math.
+// Offsets and smoothing both grow with a point's scale: the image is
+// smoothed with BRIEF_SIGMA * scale once for every distinct scale, so a
+// corner from harris_multiscale_detector at scale 2 sees what it would at
+// scale 1 in the half-size image.
+// image im: image the points were detected in.
+// descriptor *d: points to describe, e.g. from harris_corner_detector.
+//                Offsets are multiplied by each point's scale.
+// int n: number of points.
+// returns: array of n binary descriptors, free with free().
+binary_descriptor *brief_descriptors(image im, descriptor *d, int n) {
+  pthread_once(&pattern_once, make_pattern);
+  image gray = im.c == 3 ? rgb_to_grayscale(im) : im;
+
+  // Distinct scales, in order of first use.
+  float *scales = calloc(MAX(n, 1), sizeof(float));
+  int ns = 0;
+  for (int i = 0; i < n; i++) {
+    float scale = brief_scale(d[i]);
+    int u = 0;
+    while (u < ns && scales[u] != scale) u++;
+    if (u == ns) scales[ns++] = scale;
+  }
+
+  binary_descriptor *b = calloc(n, sizeof(binary_descriptor));
+  for (int u = 0; u < ns; u++) {
+    image s = smooth_image(gray, BRIEF_SIGMA * scales[u]);
+    #pragma omp parallel for
+    for (int i = 0; i < n; i++) {
+      if (brief_scale(d[i]) == scales[u]) brief_point(s, d[i], &b[i]);
+    }
+    free_image(s);
+  }
+  free(scales);
+  if (im.c == 3) free_image(gray);
+  return b;
+}
+
+// Number of bits that differ between two binary descriptors.
+int hamming_distance(binary_descriptor *a, binary_descriptor *b) {
+  int dis = 0;
+  for (int k = 0; k < BRIEF_WORDS; k++) {
+    dis += __builtin_popcountll(a->bits[k] ^ b->bits[k]);
+  }
+  return dis;
+}
+
+// Best b for every a by Hamming distance. Built for both plain x86-64 and
+// the popcnt instruction, picked at load time, since the default target
+// otherwise expands __builtin_popcountll into a bit-twiddling sequence.
+__attribute__((target_clones("popcnt", "default")))
+static void best_hamming(binary_descriptor *a, int an, binary_descriptor *b,
+                         int bn, match *m) {
+  #pragma omp parallel for
+  for (int j = 0; j < an; j++) {
+    const unsigned long long *q = a[j].bits;
+    int min_dis = BRIEF_BITS + 1;
+    int bind = 0;
+    for (int i = 0; i < bn; i++) {
+      const unsigned long long *t = b[i].bits;
+      int dis = 0;
+      for (int k = 0; k < BRIEF_WORDS; k++) {
+        dis += __builtin_popcountll(q[k] ^ t[k]);
+      }
+      if (dis < min_dis) {
+        min_dis = dis;
+        bind = i;
+      }
+    }
+    m[j].ai = j;
+    m[j].bi = bind;
+    m[j].p = a[j].p;
+    m[j].q = b[bind].p;
+    m[j].distance = min_dis;
+  }
+}
+
+// Finds best matches between binary descriptors of two images, like
+// match_descriptors but by Hamming distance.
+// binary_descriptor *a, *b: descriptors for points in two images.
+// int an, bn: number of descriptors in a and b.
+// int *mn: set to the number of matches found.
+// returns: matches sorted by distance, at most one per descriptor in b.
+match *match_binary_descriptors(binary_descriptor *a, int an,
+                                binary_descriptor *b, int bn, int *mn) {
+  match *m = calloc(an, sizeof(match));
+  if (bn == 0) {
+    *mn = 0;
+    return m;
+  }
+  best_hamming(a, an, b, bn, m);
+  *mn = unique_matches(m, an, bn);
+  return m;
+}
@@ -0,0 +1,188 @@
+#include <assert.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "image.h"
+
+// Descriptors of b compared against a block of queries before moving on,
+// sized so the tile and the queries both stay in L1.
+#define MATCH_TILE 64
+// Queries whose distances are accumulated together, sharing each load of b.
+#define MATCH_QUERIES 4
+
+// Eight floats, one row chunk. GCC lowers these to whatever vector width
+// the function is compiled for: one AVX register, two SSE ones, or scalars.
+typedef float v8sf __attribute__((vector_size(32)));
+typedef int v8si __attribute__((vector_size(32)));
+
+static inline float hsum(v8sf v) {
+  return ((v[0] + v[4]) + (v[1] + v[5])) + ((v[2] + v[6]) + (v[3] + v[7]));
+}
+
+// Distances from MATCH_QUERIES queries to one descriptor. Rows are 32-byte
+// aligned and zero padded to stride, a multiple of 8, so whole chunks can
+// be loaded and the padding adds nothing.
+// const float **q: query rows.
+// const float *t: descriptor row.
+// int l2: 1 for squared L2 distance, 0 for L1.
+// float *out: MATCH_QUERIES distances.
+static inline void distances(const float **q, const float *t, int stride,
+                             int l2, float *out) {
+  v8sf s0 = {0}, s1 = {0}, s2 = {0}, s3 = {0};
+  const v8sf *tv = (const v8sf *)t;
+  const v8sf *q0 = (const v8sf *)q[0], *q1 = (const v8sf *)q[1];
+  const v8sf *q2 = (const v8sf *)q[2], *q3 = (const v8sf *)q[3];
+  int chunks = stride / 8;
+  if (l2) {
+    for (int k = 0; k < chunks; k++) {
+      v8sf d0 = q0[k] - tv[k], d1 = q1[k] - tv[k];
+      v8sf d2 = q2[k] - tv[k], d3 = q3[k] - tv[k];
+      s0 += d0 * d0;
+      s1 += d1 * d1;
+      s2 += d2 * d2;
+      s3 += d3 * d3;
+    }
+  } else {
+    // |d| by clearing the sign bit.
+    for (int k = 0; k < chunks; k++) {
+      s0 += (v8sf)((v8si)(q0[k] - tv[k]) & 0x7fffffff);
+      s1 += (v8sf)((v8si)(q1[k] - tv[k]) & 0x7fffffff);
+      s2 += (v8sf)((v8si)(q2[k] - tv[k]) & 0x7fffffff);
+      s3 += (v8sf)((v8si)(q3[k] - tv[k]) & 0x7fffffff);
+    }
+  }
+  out[0] = hsum(s0);
+  out[1] = hsum(s1);
+  out[2] = hsum(s2);
+  out[3] = hsum(s3);
+}
+
+// Compare queries a0 to a1 - 1 against every descriptor of b, updating
+// their best and second best. Built for both plain x86-64 and AVX2, picked
+// at load time, since the library is compiled for generic x86-64.
+__attribute__((target_clones("avx2", "default")))
+static void nearest_block(descriptor_set a, descriptor_set b, int a0, int a1,
+                          int l2, int *best, float *d1, float *d2) {
+  for (int b0 = 0; b0 < b.n; b0 += MATCH_TILE) {
+    int b1 = MIN(b0 + MATCH_TILE, b.n);
+    for (int j = a0; j < a1; j += MATCH_QUERIES) {
+      const float *q[MATCH_QUERIES];
+      float m1[MATCH_QUERIES], m2[MATCH_QUERIES];
+      int bi[MATCH_QUERIES];
+      // Short final groups repeat their last query and drop the copies.
+      for (int u = 0; u < MATCH_QUERIES; u++) {
+        int r = MIN(j + u, a1 - 1);
+        q[u] = a.data + (size_t)r * a.stride;
+        m1[u] = d1[r];
+        m2[u] = d2[r];
+        bi[u] = best[r];
+      }
+      for (int i = b0; i < b1; i++) {
+        float dis[MATCH_QUERIES];
+        distances(q, b.data + (size_t)i * b.stride, a.stride, l2, dis);
+        for (int u = 0; u < MATCH_QUERIES; u++) {
+          if (dis[u] < m1[u]) {
+            m2[u] = m1[u];
+            m1[u] = dis[u];
+            bi[u] = i;
+          } else if (dis[u] < m2[u]) {
+            m2[u] = dis[u];
+          }
+        }
+      }
+      for (int u = 0; u < MATCH_QUERIES && j + u < a1; u++) {
+        d1[j + u] = m1[u];
+        d2[j + u] = m2[u];
+        best[j + u] = bi[u];
+      }
+    }
+  }
+}
+
+// Find the nearest and second nearest descriptor of b for every descriptor
+// of a, by brute force. The a x b comparisons are tiled so that a tile of
+// b is reused by every query before the next is loaded, and four queries
+// are compared to each descriptor of b at once, sharing its loads. Best
+// and second best stay in locals until a query has seen the whole tile.
+// descriptor_set a, b: descriptors to compare, of the same dim.
+// DISTANCE metric: DISTANCE_L1 or DISTANCE_L2.
+// int *best: set to the index in b of the nearest descriptor, per query.
+// float *d1, *d2: set to the nearest and second nearest distances, FLT_MAX
+//                 when b has too few descriptors.
+void nearest_two(descriptor_set a, descriptor_set b, DISTANCE metric,
+                 int *best, float *d1, float *d2) {
+  assert(a.n == 0 || b.n == 0 || a.dim == b.dim);
+  int l2 = metric == DISTANCE_L2;
+  for (int j = 0; j < a.n; j++) {
+    best[j] = 0;
+    d1[j] = d2[j] = __FLT_MAX__;
+  }
+
+  int blocks = (a.n + MATCH_TILE - 1) / MATCH_TILE;
+  #pragma omp parallel for schedule(dynamic)
+  for (int blk = 0; blk < blocks; blk++) {
+    int a0 = blk * MATCH_TILE, a1 = MIN(a0 + MATCH_TILE, a.n);
+    nearest_block(a, b, a0, a1, l2, best, d1, d2);
+  }
+
+  if (l2) {
+    for (int j = 0; j < a.n; j++) {
+      if (d1[j] < __FLT_MAX__) d1[j] = sqrtf(d1[j]);
+      if (d2[j] < __FLT_MAX__) d2[j] = sqrtf(d2[j]);
+    }
+  }
+}
+
+// Turn nearest neighbours into one-to-one matches, dropping those that
+// fail the ratio test.
+static match *matches_from_nearest(descriptor_set a, descriptor_set b,
+                                   const int *best, const float *d1,
+                                   const float *d2, float ratio, int *mn) {
+  match *m = calloc(MAX(a.n, 1), sizeof(match));
+  int count = 0;
+  for (int j = 0; j < a.n; j++) {
+    if (ratio < 1 && !(d1[j] < ratio * d2[j])) continue;
+    m[count].ai = j;
+    m[count].bi = best[j];
+    m[count].p = a.p[j];
+    m[count].q = b.p[best[j]];
+    m[count].distance = d1[j];
+    count++;
+  }
+  *mn = unique_matches(m, count, b.n);
+  return m;
+}
+
+// Finds best matches between two descriptor sets, like match_descriptors,
+// optionally with Lowe's ratio test.
+// descriptor_set a, b: descriptors of points in two images.
+// DISTANCE metric: DISTANCE_L1 or DISTANCE_L2.
+// float ratio: drop a match unless its distance is below ratio times the
+//              second nearest, e.g. .8; 1 or more keeps every match.
+// kd_forest *index: 0 to compare every pair with nearest_two, or a forest
+//                   built over b to search it approximately instead.
+// int *mn: set to the number of matches found.
+// returns: matches sorted by distance, at most one per descriptor in b.
+match *match_descriptor_sets(descriptor_set a, descriptor_set b,
+                             DISTANCE metric, float ratio, kd_forest *index,
+                             int *mn) {
+  if (b.n == 0) {
+    *mn = 0;
+    return calloc(MAX(a.n, 1), sizeof(match));
+  }
+  int *best = calloc(MAX(a.n, 1), sizeof(int));
+  float *d1 = calloc(MAX(a.n, 1), sizeof(float));
+  float *d2 = calloc(MAX(a.n, 1), sizeof(float));
+  if (index) {
+    kd_nearest_two(index, a, metric, best, d1, d2);
+  } else {
+    nearest_two(a, b, metric, best, d1, d2);
+  }
+  match *m = matches_from_nearest(a, b, best, d1, d2, ratio, mn);
+  free(best);
+  free(d1);
+  free(d2);
+  return m;
+}
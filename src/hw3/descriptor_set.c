@@ -0,0 +1,70 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "image.h"
+
+// Alignment of the descriptor buffer and of every row in it, in bytes.
+// 32 bytes is one AVX register, and rows are padded to a whole number of
+// them so vector loops never need a scalar tail.
+#define DESCRIPTOR_ALIGN 32
+#define DESCRIPTOR_LANES (DESCRIPTOR_ALIGN / sizeof(float))
+
+// Make an empty descriptor set. Points, scales and descriptors each live in
+// one buffer, and the padding at the end of every row is zero.
+// int n: number of descriptors.
+// int dim: number of floats in each descriptor.
+// returns: set with room for n descriptors of dim floats.
+descriptor_set make_descriptor_set(int n, int dim) {
+  assert(n >= 0 && dim >= 0);
+  descriptor_set s;
+  s.n = n;
+  s.dim = dim;
+  s.stride = (dim + DESCRIPTOR_LANES - 1) / DESCRIPTOR_LANES * DESCRIPTOR_LANES;
+  s.p = calloc(n, sizeof(point));
+  s.scale = calloc(n, sizeof(float));
+  size_t bytes = (size_t)n * s.stride * sizeof(float);
+  s.data = aligned_alloc(DESCRIPTOR_ALIGN, bytes ? bytes : DESCRIPTOR_ALIGN);
+  memset(s.data, 0, bytes);
+  return s;
+}
+
+void free_descriptor_set(descriptor_set s) {
+  free(s.p);
+  free(s.scale);
+  free(s.data);
+}
+
+// Pack an array of descriptors into a set. All descriptors must have the
+// same length.
+// descriptor *d: descriptors to copy.
+// int n: number of descriptors.
+// returns: set holding copies of their points, scales and data.
+descriptor_set descriptors_to_set(descriptor *d, int n) {
+  int dim = n > 0 ? d[0].n : 0;
+  descriptor_set s = make_descriptor_set(n, dim);
+  for (int i = 0; i < n; i++) {
+    assert(d[i].n == dim);
+    s.p[i] = d[i].p;
+    s.scale[i] = d[i].scale;
+    memcpy(s.data + (size_t)i * s.stride, d[i].data, dim * sizeof(float));
+  }
+  return s;
+}
+
+// Unpack a set into an array of descriptors, e.g. for code that still
+// takes descriptor arrays. Free the result with free_descriptors.
+// descriptor_set s: set to copy.
+// returns: array of s.n descriptors.
+descriptor *set_to_descriptors(descriptor_set s) {
+  descriptor *d = calloc(s.n, sizeof(descriptor));
+  for (int i = 0; i < s.n; i++) {
+    d[i].p = s.p[i];
+    d[i].n = s.dim;
+    d[i].scale = s.scale[i];
+    d[i].data = calloc(s.dim, sizeof(float));
+    memcpy(d[i].data, s.data + (size_t)i * s.stride, s.dim * sizeof(float));
+  }
+  return d;
+}
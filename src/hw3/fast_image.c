@@ -0,0 +1,403 @@
+#include <assert.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "image.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Radius of the Bresenham circle the segment test runs on.
+#define FAST_RADIUS 3
+#define FAST_CIRCLE 16
+// Rows per independent strip when collecting candidates.
+#define FAST_STRIP_H 32
+
+// The 16 pixels of a radius-3 circle, in order around it.
+static const int circle_x[FAST_CIRCLE] = {0,  1,  2,  3, 3, 3, 2, 1,
+                                          0, -1, -2, -3, -3, -3, -2, -1};
+static const int circle_y[FAST_CIRCLE] = {-3, -3, -2, -1, 0, 1, 2, 3,
+                                          3,  3,  2,  1,  0, -1, -2, -3};
+
+// A pixel that passed the segment test, with its integer score.
+typedef struct {
+  int x, y;
+  int score;
+} fast_candidate;
+
+// Growable candidate list of one strip.
+typedef struct {
+  fast_candidate *c;
+  int n, cap;
+} fast_list;
+
+static void push_candidate(fast_list *l, int x, int y, int score) {
+  if (l->n == l->cap) {
+    l->cap = l->cap ? 2 * l->cap : 256;
+    l->c = realloc(l->c, l->cap * sizeof(fast_candidate));
+  }
+  l->c[l->n].x = x;
+  l->c[l->n].y = y;
+  l->c[l->n].score = score;
+  l->n++;
+}
+
+// Whether a 16-bit circle mask has a run of at least arc set bits, 8 < arc
+// <= 16, counting runs that wrap around from the last pixel to the first.
+static inline uint32_t has_arc(uint32_t m, int arc) {
+  uint32_t r = m | (m << FAST_CIRCLE);
+  uint32_t run = r & (r >> 1);
+  run &= run >> 2;
+  run &= run >> 4;
+  return (run & (run >> (arc - 8))) != 0;
+}
+
+static inline uint8_t float_to_u8(float v) {
+  v = v * 255 + .5f;
+  return v < 0 ? 0 : (v > 255 ? 255 : (int)v);
+}
+
+// Grayscale as 8 bits in one pass: the weights of rgb_to_grayscale in
+// single precision, then the rounding of image_to_u8.
+static image_u8 gray_u8(image im) {
+  image_u8 out = make_image_u8(im.w, im.h, 1);
+  int size = im.w * im.h;
+  const float *r = im.data, *g = r + size, *b = g + size;
+  if (im.c == 1) {
+    #pragma omp parallel for
+    for (int i = 0; i < size; i++) out.data[i] = float_to_u8(r[i]);
+    return out;
+  }
+  #pragma omp parallel for
+  for (int i = 0; i < size; i++) {
+    out.data[i] = float_to_u8(r[i] * .299f + g[i] * .587f + b[i] * .114f);
+  }
+  return out;
+}
+
+// Full segment test and score of one pixel. The score is how far the
+// brighter (or darker) circle pixels clear the threshold, summed.
+// const int *off: offsets of the circle pixels from the centre.
+// returns: the score, 0 if the pixel is not a corner.
+static int fast_score(const uint8_t *p, const int *off, int arc, int t) {
+  int c = p[0];
+  uint32_t bright = 0, dark = 0;
+  int sb = 0, sd = 0;
+  // Branch free: survivors of the pretest are too mixed to predict.
+  for (int k = 0; k < FAST_CIRCLE; k++) {
+    int v = p[off[k]] - c;
+    int b = v > t, d = v < -t;
+    bright |= (uint32_t)b << k;
+    dark |= (uint32_t)d << k;
+    sb += b ? v - t : 0;
+    sd += d ? -v - t : 0;
+  }
+  int b = has_arc(bright, arc) ? sb : 0;
+  int d = has_arc(dark, arc) ? sd : 0;
+  return MAX(b, d);
+}
+
+// Whether a pixel can pass the segment test, from the four compass pixels
+// 0, 4, 8 and 12 alone. An arc of 9 to 11 covers two neighbouring compass
+// pixels and an arc of 12 covers three, all brighter or all darker.
+static inline int fast_pretest(const uint8_t *p, int w, int arc, int t) {
+  int c = p[0];
+  int pn = p[-FAST_RADIUS * w], pe = p[FAST_RADIUS];
+  int ps = p[FAST_RADIUS * w], pw = p[-FAST_RADIUS];
+  int bn = pn > c + t, be = pe > c + t, bs = ps > c + t, bw = pw > c + t;
+  int dn = pn < c - t, de = pe < c - t, ds = ps < c - t, dw = pw < c - t;
+  if (arc >= 12) {
+    return (bn & be & bs) | (be & bs & bw) | (bs & bw & bn) | (bw & bn & be) |
+           (dn & de & ds) | (de & ds & dw) | (ds & dw & dn) | (dw & dn & de);
+  }
+  return (bn & be) | (be & bs) | (bs & bw) | (bw & bn) | (dn & de) |
+         (de & ds) | (ds & dw) | (dw & dn);
+}
+
+#ifdef __SSE2__
+// All ones in the lanes where the mask of any of 16 neighbouring pixels
+// has no run of arc zeros around the circle. Spans of 2, 4 and 8 pixels
+// are ORed together by doubling, and a run of arc is two overlapping spans
+// of 8, so the cost does not depend on arc.
+// __m128i *m: per circle pixel, all ones where it fails the test.
+static inline __m128i no_arc_sse(const __m128i *m, int arc) {
+  __m128i s2[FAST_CIRCLE], s4[FAST_CIRCLE], s8[FAST_CIRCLE];
+  for (int k = 0; k < FAST_CIRCLE; k++) {
+    s2[k] = _mm_or_si128(m[k], m[(k + 1) % FAST_CIRCLE]);
+  }
+  for (int k = 0; k < FAST_CIRCLE; k++) {
+    s4[k] = _mm_or_si128(s2[k], s2[(k + 2) % FAST_CIRCLE]);
+  }
+  for (int k = 0; k < FAST_CIRCLE; k++) {
+    s8[k] = _mm_or_si128(s4[k], s4[(k + 4) % FAST_CIRCLE]);
+  }
+  __m128i r = _mm_set1_epi8(-1);
+  for (int k = 0; k < FAST_CIRCLE; k++) {
+    r = _mm_and_si128(
+        r, _mm_or_si128(s8[k], s8[(k + arc - 8) % FAST_CIRCLE]));
+  }
+  return r;
+}
+
+// Segment test and score of 16 neighbouring pixels at once. The score sums
+// p - c - t over brighter circle pixels or c - t - p over darker ones,
+// which are exactly what the saturating differences leave.
+// const uint8_t *p: first of the pixels.
+// uint16_t *score: set to the 16 scores, 0 where there is no corner.
+// returns: bit k set if pixel k is a corner.
+static int fast_block(const uint8_t *p, const int *off, int arc, __m128i tv,
+                      uint16_t *score) {
+  __m128i zero = _mm_setzero_si128();
+  __m128i c = _mm_loadu_si128((const __m128i *)p);
+  __m128i hi = _mm_adds_epu8(c, tv), lo = _mm_subs_epu8(c, tv);
+  __m128i nb[FAST_CIRCLE], nd[FAST_CIRCLE];
+  __m128i sb0 = zero, sb1 = zero, sd0 = zero, sd1 = zero;
+  for (int k = 0; k < FAST_CIRCLE; k++) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(p + off[k]));
+    __m128i b = _mm_subs_epu8(v, hi), d = _mm_subs_epu8(lo, v);
+    nb[k] = _mm_cmpeq_epi8(b, zero);
+    nd[k] = _mm_cmpeq_epi8(d, zero);
+    sb0 = _mm_add_epi16(sb0, _mm_unpacklo_epi8(b, zero));
+    sb1 = _mm_add_epi16(sb1, _mm_unpackhi_epi8(b, zero));
+    sd0 = _mm_add_epi16(sd0, _mm_unpacklo_epi8(d, zero));
+    sd1 = _mm_add_epi16(sd1, _mm_unpackhi_epi8(d, zero));
+  }
+  __m128i cb = _mm_andnot_si128(no_arc_sse(nb, arc), _mm_set1_epi8(-1));
+  __m128i cd = _mm_andnot_si128(no_arc_sse(nd, arc), _mm_set1_epi8(-1));
+  int corners = _mm_movemask_epi8(_mm_or_si128(cb, cd));
+  if (!corners) return 0;
+  __m128i s0 = _mm_max_epi16(_mm_and_si128(sb0, _mm_unpacklo_epi8(cb, cb)),
+                             _mm_and_si128(sd0, _mm_unpacklo_epi8(cd, cd)));
+  __m128i s1 = _mm_max_epi16(_mm_and_si128(sb1, _mm_unpackhi_epi8(cb, cb)),
+                             _mm_and_si128(sd1, _mm_unpackhi_epi8(cd, cd)));
+  _mm_storeu_si128((__m128i *)score, s0);
+  _mm_storeu_si128((__m128i *)(score + 8), s1);
+  return corners;
+}
+#endif
+
+// Collect the corners of rows y0 to y1 - 1. With SSE2, 16 pixels are
+// tested at a time: the compass pretest rejects most blocks outright, and
+// the full test and scores run in vector registers only for the rest.
+static void fast_rows(image_u8 g, int y0, int y1, int arc, int t,
+                      fast_list *out) {
+  int w = g.w, x0 = FAST_RADIUS, x1 = w - FAST_RADIUS;
+  int off[FAST_CIRCLE];
+  for (int k = 0; k < FAST_CIRCLE; k++) off[k] = circle_y[k] * w + circle_x[k];
+  for (int y = y0; y < y1; y++) {
+    const uint8_t *row = g.data + y * w;
+    int x = x0;
+#ifdef __SSE2__
+    __m128i tv = _mm_set1_epi8((char)t), zero = _mm_setzero_si128();
+    for (; x + 16 <= x1; x += 16) {
+      __m128i c = _mm_loadu_si128((const __m128i *)(row + x));
+      __m128i hi = _mm_adds_epu8(c, tv), lo = _mm_subs_epu8(c, tv);
+      __m128i pn = _mm_loadu_si128((const __m128i *)(row + x - 3 * w));
+      __m128i pe = _mm_loadu_si128((const __m128i *)(row + x + 3));
+      __m128i ps = _mm_loadu_si128((const __m128i *)(row + x + 3 * w));
+      __m128i pw = _mm_loadu_si128((const __m128i *)(row + x - 3));
+      // All ones where a compass pixel is not brighter (darker) than c.
+      __m128i bn = _mm_cmpeq_epi8(_mm_subs_epu8(pn, hi), zero);
+      __m128i be = _mm_cmpeq_epi8(_mm_subs_epu8(pe, hi), zero);
+      __m128i bs = _mm_cmpeq_epi8(_mm_subs_epu8(ps, hi), zero);
+      __m128i bw = _mm_cmpeq_epi8(_mm_subs_epu8(pw, hi), zero);
+      __m128i dn = _mm_cmpeq_epi8(_mm_subs_epu8(lo, pn), zero);
+      __m128i de = _mm_cmpeq_epi8(_mm_subs_epu8(lo, pe), zero);
+      __m128i ds = _mm_cmpeq_epi8(_mm_subs_epu8(lo, ps), zero);
+      __m128i dw = _mm_cmpeq_epi8(_mm_subs_epu8(lo, pw), zero);
+      __m128i rb, rd;
+      if (arc >= 12) {
+        rb = _mm_and_si128(
+            _mm_and_si128(_mm_or_si128(bn, _mm_or_si128(be, bs)),
+                          _mm_or_si128(be, _mm_or_si128(bs, bw))),
+            _mm_and_si128(_mm_or_si128(bs, _mm_or_si128(bw, bn)),
+                          _mm_or_si128(bw, _mm_or_si128(bn, be))));
+        rd = _mm_and_si128(
+            _mm_and_si128(_mm_or_si128(dn, _mm_or_si128(de, ds)),
+                          _mm_or_si128(de, _mm_or_si128(ds, dw))),
+            _mm_and_si128(_mm_or_si128(ds, _mm_or_si128(dw, dn)),
+                          _mm_or_si128(dw, _mm_or_si128(dn, de))));
+      } else {
+        rb = _mm_and_si128(
+            _mm_and_si128(_mm_or_si128(bn, be), _mm_or_si128(be, bs)),
+            _mm_and_si128(_mm_or_si128(bs, bw), _mm_or_si128(bw, bn)));
+        rd = _mm_and_si128(
+            _mm_and_si128(_mm_or_si128(dn, de), _mm_or_si128(de, ds)),
+            _mm_and_si128(_mm_or_si128(ds, dw), _mm_or_si128(dw, dn)));
+      }
+      // Skip the block if no pixel has a bright or a dark pair (triple).
+      if (_mm_movemask_epi8(_mm_and_si128(rb, rd)) == 0xffff) continue;
+
+      uint16_t score[16];
+      int corners = fast_block(row + x, off, arc, tv, score);
+      while (corners) {
+        int k = __builtin_ctz(corners);
+        corners &= corners - 1;
+        push_candidate(out, x + k, y, score[k]);
+      }
+    }
+#endif
+    for (; x < x1; x++) {
+      if (!fast_pretest(row + x, w, arc, t)) continue;
+      int score = fast_score(row + x, off, arc, t);
+      if (score) push_candidate(out, x, y, score);
+    }
+  }
+}
+
+// Find every pixel that passes the segment test, in raster order.
+// int *n: set to the number of candidates.
+// returns: the candidates, free with free().
+static fast_candidate *fast_candidates(image im, int arc, float thresh,
+                                       int *n) {
+  assert(arc >= 9 && arc <= 12);
+  assert(im.c == 1 || im.c == 3);
+  image_u8 g = gray_u8(im);
+  int t = (int)roundf(thresh * 255);
+  t = MIN(MAX(t, 0), 255);
+  int y0 = FAST_RADIUS, y1 = MAX(im.h - FAST_RADIUS, y0);
+  int x1 = im.w - FAST_RADIUS;
+  int strips = x1 > FAST_RADIUS ? (y1 - y0 + FAST_STRIP_H - 1) / FAST_STRIP_H
+                                : 0;
+  fast_list *lists = calloc(MAX(strips, 1), sizeof(fast_list));
+
+  #pragma omp parallel for schedule(dynamic)
+  for (int s = 0; s < strips; s++) {
+    int a = y0 + s * FAST_STRIP_H;
+    fast_rows(g, a, MIN(a + FAST_STRIP_H, y1), arc, t, &lists[s]);
+  }
+
+  int count = 0;
+  for (int s = 0; s < strips; s++) count += lists[s].n;
+  fast_candidate *c = malloc(MAX(count, 1) * sizeof(fast_candidate));
+  count = 0;
+  for (int s = 0; s < strips; s++) {
+    memcpy(c + count, lists[s].c, lists[s].n * sizeof(fast_candidate));
+    count += lists[s].n;
+    free(lists[s].c);
+  }
+  free(lists);
+  free_image_u8(g);
+  *n = count;
+  return c;
+}
+
+// Write the scores of the candidates of row y into the ring of rows, or
+// clear them again, so the ring never needs a full reset.
+static void ring_row(uint16_t *ring, int rows, int w, const fast_candidate *c,
+                     const int *first, int y, int clear) {
+  uint16_t *r = ring + (y % rows) * w;
+  for (int k = first[y]; k < first[y + 1]; k++) {
+    r[c[k].x] = clear ? 0 : c[k].score;
+  }
+}
+
+// Non-max suppression over candidates in raster order: keep those whose
+// score is at least that of every candidate within nms pixels, the same
+// as nms_candidates on the score map. Scores are only written for the
+// 2 * nms + 1 rows around the current one, into a ring that stays in
+// cache, and only candidates look for larger neighbours, so the cost grows
+// with the number of candidates rather than the image size.
+// int *n: number of candidates, set to the number kept.
+// returns: indexes of the kept candidates in raster order.
+static int *fast_nms(fast_candidate *c, int *n, int w, int h, int nms) {
+  int count = *n;
+  // Candidates of row y are c[first[y]] to c[first[y + 1] - 1].
+  int *first = calloc(h + 1, sizeof(int));
+  for (int k = 0; k < count; k++) first[c[k].y + 1]++;
+  for (int y = 0; y < h; y++) first[y + 1] += first[y];
+  char *keep = calloc(MAX(count, 1), 1);
+  int rows = 2 * nms + 1;
+  int strips = (h + FAST_STRIP_H - 1) / FAST_STRIP_H;
+
+  #pragma omp parallel
+  {
+    uint16_t *ring = calloc((size_t)rows * w, sizeof(uint16_t));
+    #pragma omp for schedule(dynamic)
+    for (int t = 0; t < strips; t++) {
+      int y0 = t * FAST_STRIP_H, y1 = MIN(y0 + FAST_STRIP_H, h);
+      for (int y = MAX(y0 - nms, 0); y < MIN(y0 + nms, h); y++) {
+        ring_row(ring, rows, w, c, first, y, 0);
+      }
+      for (int y = y0; y < y1; y++) {
+        if (y - nms - 1 >= 0 && y > y0) {
+          ring_row(ring, rows, w, c, first, y - nms - 1, 1);
+        }
+        if (y + nms < h) ring_row(ring, rows, w, c, first, y + nms, 0);
+        if (first[y] == first[y + 1]) continue;
+        int ya = MAX(y - nms, 0), yb = MIN(y + nms, h - 1), nr = 0;
+        const uint16_t *near[rows];
+        for (int r = ya; r <= yb; r++) near[nr++] = ring + (r % rows) * w;
+        for (int k = first[y]; k < first[y + 1]; k++) {
+          int xa = MAX(c[k].x - nms, 0), xb = MIN(c[k].x + nms, w - 1);
+          int m = 0;
+          for (int r = 0; r < nr; r++) {
+            for (int x = xa; x <= xb; x++) m = MAX(m, near[r][x]);
+          }
+          keep[k] = m <= c[k].score;
+        }
+      }
+      for (int y = MAX(y1 - 1 - nms, 0); y < MIN(y1 + nms, h); y++) {
+        ring_row(ring, rows, w, c, first, y, 1);
+      }
+    }
+    free(ring);
+  }
+
+  int kept = 0;
+  int *idx = malloc(MAX(count, 1) * sizeof(int));
+  for (int k = 0; k < count; k++) {
+    if (keep[k]) idx[kept++] = c[k].y * w + c[k].x;
+  }
+  free(first);
+  free(keep);
+  *n = kept;
+  return idx;
+}
+
+// Compute FAST corner scores for every pixel of an image. The test runs
+// on the image rounded to 8 bits, like image_to_u8 of its grayscale.
+// image im: input image, converted to grayscale if it has 3 channels.
+// int arc: contiguous circle pixels needed, 9 to 12.
+// float thresh: how much brighter or darker than the centre they must be,
+//               rounded to a multiple of 1/255.
+// returns: 1-channel score map, 0 where there is no corner.
+image fast_response(image im, int arc, float thresh) {
+  int n;
+  fast_candidate *c = fast_candidates(im, arc, thresh, &n);
+  image S = make_image(im.w, im.h, 1);
+  for (int k = 0; k < n; k++) {
+    S.data[c[k].y * im.w + c[k].x] = c[k].score / 255.f;
+  }
+  free(c);
+  return S;
+}
+
+// Detect FAST corners (Rosten and Drummond) and describe them like
+// harris_corner_detector, so the result works with match_descriptors and
+// RANSAC unchanged. Corners are thinned by keeping local maxima of the
+// score within nms pixels, comparing candidates only, so no score map is
+// built.
+// image im: input image.
+// int arc: contiguous circle pixels needed, 9 for FAST-9 up to 12.
+// float thresh: intensity difference for the segment test, e.g. 20/255.
+// int nms: distance to look for higher scores.
+// int *n: set to the number of corners.
+// returns: array of descriptors of the corners in the image.
+descriptor *fast_corner_detector(image im, int arc, float thresh, int nms,
+                                 int *n) {
+  int count;
+  fast_candidate *c = fast_candidates(im, arc, thresh, &count);
+  int *idx = fast_nms(c, &count, im.w, im.h, MAX(nms, 0));
+  descriptor *d = calloc(count, sizeof(descriptor));
+  #pragma omp parallel for
+  for (int i = 0; i < count; i++) d[i] = describe_index(im, idx[i]);
+  *n = count;
+  free(idx);
+  free(c);
+  return d;
+}
@@ -1,4 +1,5 @@
 #include <assert.h>
+#include <float.h>
 #include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -9,6 +10,20 @@
 #include "matrix.h"
 
 #define DO_1D_SMOOTHING 0
+// smooth_image switches to the recursive Gaussian from this sigma up.
+#define RECURSIVE_SMOOTH_MIN_SIGMA 4
+// Rows per independent strip of harris_response.
+#define HARRIS_STRIP_H 128
+// Columns processed together by the vertical pass of max_filter_image.
+#define NMS_STRIP_W 64
+// A corner only suppresses another in ANMS if it is clearly stronger.
+#define ANMS_ROBUST 0.9
+// Average corners per cell of the ANMS search grid.
+#define ANMS_CELL_POINTS 2
+// Corner budget per cell that CORNERS_GRID aims for.
+#define GRID_CELL_CORNERS 8
+// Grid cells drop corners weaker than this fraction of their strongest.
+#define GRID_QUALITY 0.01
 
 // Frees an array of descriptors.
 // descriptor *d: the array.
@@ -26,23 +41,34 @@ void free_descriptors(descriptor *d, int n) {
 // int i: index in image for the pixel we want to describe.
 // returns: descriptor for that index.
 descriptor describe_index(image im, int i) {
-  int w = 5;
+  int w = 5, r = w / 2;
+  int x = i % im.w, y = i / im.w;
   descriptor d;
-  d.p.x = i % im.w;
-  d.p.y = i / im.w;
+  d.p.x = x;
+  d.p.y = y;
   d.data = calloc(w * w * im.c, sizeof(float));
   d.n = w * w * im.c;
-  int c, dx, dy;
-  int count = 0;
+  d.scale = 1;
+  // Patches clear of the border are read straight from the channel planes;
+  // only the few corners near an edge pay for clamping.
+  int inside = x >= r && y >= r && x < im.w - r && y < im.h - r;
+  float *out = d.data;
   // If you want you can experiment with other descriptors
   // This subtracts the central value from neighbors
   // to compensate some for exposure/lighting changes.
-  for (c = 0; c < im.c; ++c) {
-    float cval = im.data[c * im.w * im.h + i];
-    for (dx = -w / 2; dx < (w + 1) / 2; ++dx) {
-      for (dy = -w / 2; dy < (w + 1) / 2; ++dy) {
-        float val = get_pixel(im, i % im.w + dx, i / im.w + dy, c);
-        d.data[count++] = cval - val;
+  for (int c = 0; c < im.c; ++c) {
+    const float *chan = im.data + c * im.w * im.h;
+    float cval = chan[i];
+    for (int dx = -r; dx <= r; ++dx) {
+      if (inside) {
+        const float *col = chan + i + dx;
+        for (int dy = -r; dy <= r; ++dy) *out++ = cval - col[dy * im.w];
+        continue;
+      }
+      int px = MIN(MAX(x + dx, 0), im.w - 1);
+      for (int dy = -r; dy <= r; ++dy) {
+        int py = MIN(MAX(y + dy, 0), im.h - 1);
+        *out++ = cval - chan[py * im.w + px];
       }
     }
   }
@@ -96,29 +122,52 @@ image make_1d_gaussian(float sigma) {
   return filter;
 }
 
-// Smooths an image using separable Gaussian filter.
+// Smooths an image with a Gaussian, using the given method.
 // image im: image to smooth.
 // float sigma: std dev. for Gaussian.
+// SMOOTH method: how to compute the blur. SMOOTH_AUTO uses the recursive
+//                filter from RECURSIVE_SMOOTH_MIN_SIGMA up, and direct or
+//                separable convolution (DO_1D_SMOOTHING) below it.
 // returns: smoothed image.
-image smooth_image(image im, float sigma) {
-  if (DO_1D_SMOOTHING) {
-    image g = make_1d_gaussian(sigma);
+image smooth_image_method(image im, float sigma, SMOOTH method) {
+  if (method == SMOOTH_AUTO) {
+    if (sigma >= RECURSIVE_SMOOTH_MIN_SIGMA)
+      method = SMOOTH_RECURSIVE;
+    else
+      method = DO_1D_SMOOTHING ? SMOOTH_SEPARABLE : SMOOTH_DIRECT;
+  }
+  if (method == SMOOTH_RECURSIVE && sigma < 0.5) method = SMOOTH_SEPARABLE;
+
+  if (method == SMOOTH_RECURSIVE) {
+    return recursive_gaussian_image(im, sigma);
+  } else if (method == SMOOTH_BOX) {
+    return iterated_box_image(im, sigma, 3);
+  } else if (method == SMOOTH_SEPARABLE) {
+    image g = gaussian_kernel(sigma, 1);
     image s1 = convolve_image(im, g, 1);
     float gh = g.h;
     g.h = g.w;
     g.w = gh;
     image s2 = convolve_image(s1, g, 1);
-    free_image(g);
     free_image(s1);
+    release_gaussian_kernel(sigma, g);
     return s2;
   } else {
-    image g = make_gaussian_filter(sigma);
+    image g = gaussian_kernel(sigma, 0);
     image s = convolve_image(im, g, 1);
-    free_image(g);
+    release_gaussian_kernel(sigma, g);
     return s;
   }
 }
 
+// Smooths an image using a Gaussian filter.
+// image im: image to smooth.
+// float sigma: std dev. for Gaussian.
+// returns: smoothed image.
+image smooth_image(image im, float sigma) {
+  return smooth_image_method(im, sigma, SMOOTH_AUTO);
+}
+
 // Calculate the structure matrix of an image.
 // image im: the input image.
 // float sigma: std dev. to use for weighted sum.
@@ -126,12 +175,12 @@ image smooth_image(image im, float sigma) {
 //          third channel is IxIy.
 image structure_matrix(image im, float sigma) {
   image Is = make_image(im.w, im.h, 3);
-  image gx_filter = make_gx_filter();
-  image gy_filter = make_gy_filter();
-  image Ix = convolve_image(im, gx_filter, 0);
-  image Iy = convolve_image(im, gy_filter, 0);
-  free_image(gx_filter);
-  free_image(gy_filter);
+  image filters[2] = {make_gx_filter(), make_gy_filter()};
+  image grads[2];
+  convolve_filter_bank(im, filters, 2, grads, 0);
+  image Ix = grads[0], Iy = grads[1];
+  free_image(filters[0]);
+  free_image(filters[1]);
 
   int size = im.h * im.w;
   for (int i = 0; i < size; i++) {
@@ -169,32 +218,625 @@ image cornerness_response(image S) {
   return R;
 }
 
+// Sobel gradients of one row, summed over channels like convolve_image with
+// preserve=0, with clamped borders.
+// int y: row.
+// float *gx, *gy: output rows of im.w floats.
+static void gradient_row(image im, int y, float *gx, float *gy) {
+  int w = im.w;
+  memset(gx, 0, w * sizeof(float));
+  memset(gy, 0, w * sizeof(float));
+  for (int c = 0; c < im.c; c++) {
+    const float *chan = im.data + c * w * im.h;
+    const float *a = chan + MAX(y - 1, 0) * w;
+    const float *b = chan + y * w;
+    const float *d = chan + MIN(y + 1, im.h - 1) * w;
+    for (int x = 1; x < w - 1; x++) {
+      gx[x] += (a[x + 1] - a[x - 1]) + 2 * (b[x + 1] - b[x - 1]) +
+               (d[x + 1] - d[x - 1]);
+      gy[x] += (d[x - 1] + 2 * d[x] + d[x + 1]) -
+               (a[x - 1] + 2 * a[x] + a[x + 1]);
+    }
+    for (int x = 0; x < w; x += MAX(w - 1, 1)) {
+      int l = MAX(x - 1, 0), r = MIN(x + 1, w - 1);
+      gx[x] += (a[r] - a[l]) + 2 * (b[r] - b[l]) + (d[r] - d[l]);
+      gy[x] += (d[l] + 2 * d[x] + d[r]) - (a[l] + 2 * a[x] + a[r]);
+    }
+  }
+}
+
+// Structure matrix products of one row, blurred horizontally.
+// const float *g: 1d Gaussian of kw taps.
+// float *pad: scratch, 3 * (im.w + kw - 1) floats.
+// float *out: 3 rows of im.w floats, Ixx, Iyy and Ixy.
+static void structure_row(image im, int y, const float *g, int kw,
+                          float *gx, float *gy, float *pad, float *out) {
+  int w = im.w, r = (kw - 1) / 2, pw = w + kw - 1;
+  gradient_row(im, y, gx, gy);
+  for (int j = 0; j < pw; j++) {
+    int x = MIN(MAX(j - r, 0), w - 1);
+    pad[j] = gx[x] * gx[x];
+    pad[pw + j] = gy[x] * gy[x];
+    pad[2 * pw + j] = gx[x] * gy[x];
+  }
+  for (int c = 0; c < 3; c++) {
+    float *o = out + c * w;
+    const float *p = pad + c * pw;
+    memset(o, 0, w * sizeof(float));
+    for (int i = 0; i < kw; i++) {
+      for (int x = 0; x < w; x++) o[x] += g[i] * p[x + i];
+    }
+  }
+}
+
+// Scratch rows for harris_strip, one set per thread.
+typedef struct {
+  float *ring, *gx, *gy, *pad, *acc;
+} harris_scratch;
+
+static harris_scratch make_harris_scratch(int w, int k) {
+  harris_scratch s;
+  s.ring = calloc(k * 3 * w, sizeof(float));
+  s.gx = calloc(w, sizeof(float));
+  s.gy = calloc(w, sizeof(float));
+  s.pad = calloc(3 * (w + k - 1), sizeof(float));
+  s.acc = calloc(3 * w, sizeof(float));
+  return s;
+}
+
+static void free_harris_scratch(harris_scratch s) {
+  free(s.ring);
+  free(s.gx);
+  free(s.gy);
+  free(s.pad);
+  free(s.acc);
+}
+
+// Harris response of rows y0 to y1 - 1. Gradients and structure matrix
+// products are formed and blurred horizontally one row at a time into a
+// ring buffer of kernel-height rows, then the ring is blurred vertically
+// and the response evaluated, so no full-size intermediate is needed.
+// image g: separable Gaussian of the structure matrix window.
+// float *out: (y1 - y0) rows of im.w responses.
+static void harris_strip(image im, image g, int y0, int y1, harris_scratch s,
+                         float *out) {
+  int k = g.w, r = (k - 1) / 2, w = im.w;
+  // Ring slot v % k holds the blurred products of row clamp(v).
+  for (int v = y0 - r; v < y1 + r; v++) {
+    int sy = MIN(MAX(v, 0), im.h - 1);
+    float *slot = s.ring + ((v % k + k) % k) * 3 * w;
+    structure_row(im, sy, g.data, k, s.gx, s.gy, s.pad, slot);
+    if (v < y0 + r) continue;
+
+    int y = v - r;
+    memset(s.acc, 0, 3 * w * sizeof(float));
+    for (int j = 0; j < k; j++) {
+      const float *row = s.ring + (((y - r + j) % k + k) % k) * 3 * w;
+      for (int x = 0; x < 3 * w; x++) s.acc[x] += g.data[j] * row[x];
+    }
+    float *o = out + (y - y0) * w;
+    for (int x = 0; x < w; x++) {
+      o[x] = get_cornerness_pixel(s.acc[x], s.acc[w + x], s.acc[2 * w + x],
+                                  0.06);
+    }
+  }
+}
+
+// Compute the Harris cornerness response in one fused pass, a strip of
+// rows per task (see harris_strip). Borders behave as in
+// cornerness_response(structure_matrix(im, sigma)) with a separable
+// Gaussian.
+// image im: the input image.
+// float sigma: std dev. of the structure matrix window.
+// returns: response map, as from cornerness_response.
+image harris_response(image im, float sigma) {
+  image g = gaussian_kernel(sigma, 1);
+  image R = make_image(im.w, im.h, 1);
+  int strips = (im.h + HARRIS_STRIP_H - 1) / HARRIS_STRIP_H;
+
+  #pragma omp parallel
+  {
+    harris_scratch s = make_harris_scratch(im.w, g.w);
+    #pragma omp for schedule(dynamic)
+    for (int t = 0; t < strips; t++) {
+      int y0 = t * HARRIS_STRIP_H, y1 = MIN(y0 + HARRIS_STRIP_H, im.h);
+      harris_strip(im, g, y0, y1, s, R.data + y0 * im.w);
+    }
+    free_harris_scratch(s);
+  }
+  release_gaussian_kernel(sigma, g);
+  return R;
+}
+
+// Running max over windows of 2w+1 samples, van Herk and Gil-Werman's way:
+// split the padded line into blocks of 2w+1, take prefix maxima g and
+// suffix maxima h within each block, and every window is max(h[x], g[x+2w]).
+// Cost is three comparisons per sample whatever w is.
+// float *f: line of n + 2w samples, padded with -FLT_MAX on both ends.
+// float *g, *h: scratch, n + 2w floats each.
+// float *out: n window maxima.
+static void running_max(const float *f, int n, int w, float *g, float *h,
+                        float *out) {
+  int k = 2 * w + 1, len = n + 2 * w;
+  for (int b = 0; b < len; b += k) {
+    int e = MIN(b + k, len);
+    g[b] = f[b];
+    for (int j = b + 1; j < e; j++) g[j] = MAX(g[j - 1], f[j]);
+    h[e - 1] = f[e - 1];
+    for (int j = e - 2; j >= b; j--) h[j] = MAX(h[j + 1], f[j]);
+  }
+  for (int x = 0; x < n; x++) out[x] = MAX(h[x], g[x + 2 * w]);
+}
+
+// Same as running_max down a strip of sw columns, a row at a time.
+// float *f: n + 2w rows of sw samples, padded with rows of -FLT_MAX.
+static void running_max_strip(const float *f, int n, int w, int sw, float *g,
+                              float *h, float *out) {
+  int k = 2 * w + 1, len = n + 2 * w;
+  for (int b = 0; b < len; b += k) {
+    int e = MIN(b + k, len);
+    memcpy(g + b * sw, f + b * sw, sw * sizeof(float));
+    for (int j = b + 1; j < e; j++) {
+      const float *fj = f + j * sw;
+      float *gj = g + j * sw;
+      for (int x = 0; x < sw; x++) gj[x] = MAX(gj[x - sw], fj[x]);
+    }
+    memcpy(h + (e - 1) * sw, f + (e - 1) * sw, sw * sizeof(float));
+    for (int j = e - 2; j >= b; j--) {
+      const float *fj = f + j * sw;
+      float *hj = h + j * sw;
+      for (int x = 0; x < sw; x++) hj[x] = MAX(hj[x + sw], fj[x]);
+    }
+  }
+  for (int y = 0; y < n; y++) {
+    const float *hy = h + y * sw, *gy = g + (y + 2 * w) * sw;
+    for (int x = 0; x < sw; x++) out[y * sw + x] = MAX(hy[x], gy[x]);
+  }
+}
+
+// Maximum of each (2w+1) x (2w+1) window, clipped to the image, as two
+// separable running-max passes.
+// image im: 1-channel image.
+// int w: radius of the window.
+// returns: image of window maxima.
+image max_filter_image(image im, int w) {
+  assert(im.c == 1 && w >= 0);
+  image result = make_image(im.w, im.h, 1);
+
+  #pragma omp parallel
+  {
+    int len = im.w + 2 * w;
+    float *f = calloc(3 * len, sizeof(float));
+    float *g = f + len, *h = f + 2 * len;
+    for (int j = 0; j < w; j++) f[j] = f[len - 1 - j] = -FLT_MAX;
+    #pragma omp for
+    for (int y = 0; y < im.h; y++) {
+      memcpy(f + w, im.data + y * im.w, im.w * sizeof(float));
+      running_max(f, im.w, w, g, h, result.data + y * im.w);
+    }
+    free(f);
+  }
+
+  int strips = (im.w + NMS_STRIP_W - 1) / NMS_STRIP_W;
+  #pragma omp parallel
+  {
+    int len = im.h + 2 * w;
+    float *f = calloc(3 * len * NMS_STRIP_W, sizeof(float));
+    float *g = f + len * NMS_STRIP_W, *h = f + 2 * len * NMS_STRIP_W;
+    float *out = calloc(im.h * NMS_STRIP_W, sizeof(float));
+    #pragma omp for
+    for (int t = 0; t < strips; t++) {
+      int x0 = t * NMS_STRIP_W, sw = MIN(NMS_STRIP_W, im.w - x0);
+      for (int j = 0; j < len; j++) {
+        float *fj = f + j * sw;
+        if (j < w || j >= im.h + w) {
+          for (int x = 0; x < sw; x++) fj[x] = -FLT_MAX;
+        } else {
+          memcpy(fj, result.data + (j - w) * im.w + x0, sw * sizeof(float));
+        }
+      }
+      running_max_strip(f, im.h, w, sw, g, h, out);
+      for (int y = 0; y < im.h; y++) {
+        memcpy(result.data + y * im.w + x0, out + y * sw, sw * sizeof(float));
+      }
+    }
+    free(f);
+    free(out);
+  }
+  return result;
+}
+
 // Perform non-max supression on an image of feature responses.
 // image im: 1-channel image of feature responses.
 // int w: distance to look for larger responses.
 // returns: image with only local-maxima responses within w pixels.
 image nms_image(image im, int w) {
-  image r = copy_image(im);
-  for (int y = 0; y < im.h; y++) {
-    int wy_start = y - w, wy_end = y + w;
-    wy_start = wy_start > 0 ? wy_start : 0;
-    wy_end = wy_end < im.h ? wy_end : im.h - 1;
-
-    for (int x = 0; x < im.w; x++) {
-      int wx_start = x - w, wx_end = x + w;
-      wx_start = wx_start > 0 ? wx_start : 0;
-      wx_end = wx_end < im.w ? wx_end : im.w - 1;
-
-      for (int wy = wy_start; wy <= wy_end; wy++) {
-        for (int wx = wx_start; wx <= wx_end; wx++) {
-          if (wy == y && wx == x) continue;
-          if (get_pixel(im, wx, wy, 0) > get_pixel(im, x, y, 0))
-            set_pixel(r, x, y, 0, __FLT_MIN__);
+  image r = max_filter_image(im, w);
+  int size = im.w * im.h;
+  for (int i = 0; i < size; i++) {
+    r.data[i] = im.data[i] >= r.data[i] ? im.data[i] : __FLT_MIN__;
+  }
+  return r;
+}
+
+// Find the local maxima of a response map above a threshold. A pixel is
+// kept when no pixel within w of it is larger, as in nms_image.
+// image im: 1-channel image of feature responses.
+// int w: distance to look for larger responses.
+// float thresh: minimum response.
+// int *n: set to the number of maxima.
+// returns: indexes of the maxima in raster order.
+int *nms_candidates(image im, int w, float thresh, int *n) {
+  image m = max_filter_image(im, w);
+  int size = im.w * im.h;
+  int count = 0, cap = 64;
+  int *idx = calloc(cap, sizeof(int));
+  for (int i = 0; i < size; i++) {
+    if (im.data[i] > thresh && im.data[i] >= m.data[i]) {
+      if (count == cap) {
+        cap *= 2;
+        idx = realloc(idx, cap * sizeof(int));
+      }
+      idx[count++] = i;
+    }
+  }
+  free_image(m);
+  *n = count;
+  return idx;
+}
+
+// A bounded min-heap that keeps the k entries with the largest keys.
+typedef struct {
+  float *key;
+  int *val;
+  int n, k;
+} top_heap;
+
+static top_heap make_top_heap(int k) {
+  top_heap h;
+  h.key = calloc(k, sizeof(float));
+  h.val = calloc(k, sizeof(int));
+  h.n = 0;
+  h.k = k;
+  return h;
+}
+
+static void free_top_heap(top_heap h) {
+  free(h.key);
+  free(h.val);
+}
+
+static void top_heap_swap(top_heap *h, int a, int b) {
+  float tk = h->key[a];
+  int tv = h->val[a];
+  h->key[a] = h->key[b];
+  h->val[a] = h->val[b];
+  h->key[b] = tk;
+  h->val[b] = tv;
+}
+
+static void top_heap_sift_down(top_heap *h, int i) {
+  while (1) {
+    int l = 2 * i + 1, r = l + 1, m = i;
+    if (l < h->n && h->key[l] < h->key[m]) m = l;
+    if (r < h->n && h->key[r] < h->key[m]) m = r;
+    if (m == i) return;
+    top_heap_swap(h, i, m);
+    i = m;
+  }
+}
+
+// Offer an entry, dropping the smallest if the heap is full.
+static void top_heap_push(top_heap *h, float key, int val) {
+  if (h->n < h->k) {
+    int i = h->n++;
+    h->key[i] = key;
+    h->val[i] = val;
+    while (i > 0 && h->key[(i - 1) / 2] > h->key[i]) {
+      top_heap_swap(h, i, (i - 1) / 2);
+      i = (i - 1) / 2;
+    }
+  } else if (h->k > 0 && key > h->key[0]) {
+    h->key[0] = key;
+    h->val[0] = val;
+    top_heap_sift_down(h, 0);
+  }
+}
+
+// Empty the heap into out, largest key first.
+static void top_heap_drain(top_heap *h, int *out) {
+  while (h->n > 0) {
+    out[h->n - 1] = h->val[0];
+    h->key[0] = h->key[h->n - 1];
+    h->val[0] = h->val[h->n - 1];
+    h->n--;
+    top_heap_sift_down(h, 0);
+  }
+}
+
+// Keep the k strongest of a set of corners.
+// image R: response map.
+// int *idx: n candidate indexes into R.
+// int k: number of corners to keep.
+// int *m: set to the number kept, min(n, k).
+// returns: indexes of the kept corners, strongest first.
+int *top_k_corners(image R, const int *idx, int n, int k, int *m) {
+  top_heap h = make_top_heap(MIN(n, k));
+  for (int i = 0; i < n; i++) top_heap_push(&h, R.data[idx[i]], idx[i]);
+  *m = h.n;
+  int *out = calloc(MAX(h.n, 1), sizeof(int));
+  top_heap_drain(&h, out);
+  free_top_heap(h);
+  return out;
+}
+
+// A corner and its response, for sorting.
+typedef struct {
+  float r;
+  int i;
+} corner_response;
+
+static int compare_response_desc(const void *a, const void *b) {
+  float ra = ((const corner_response *)a)->r;
+  float rb = ((const corner_response *)b)->r;
+  return (ra < rb) - (ra > rb);
+}
+
+// Keep k well spread corners by adaptive non-maximal suppression (Brown,
+// Szeliski and Winder). Each corner's radius is its distance to the
+// nearest corner that is clearly stronger, R_i < ANMS_ROBUST * R_j, and the
+// corners with the largest radii are kept. Stronger corners are inserted
+// into a uniform grid in order of response, and the nearest one is found
+// by searching rings of cells outwards from the corner.
+// image R: response map.
+// int *idx: n candidate indexes into R.
+// int k: number of corners to keep.
+// int *m: set to the number kept, min(n, k).
+// returns: indexes of the kept corners, largest radius first.
+int *anms_corners(image R, const int *idx, int n, int k, int *m) {
+  corner_response *order = calloc(MAX(n, 1), sizeof(corner_response));
+  for (int i = 0; i < n; i++) {
+    order[i].r = R.data[idx[i]];
+    order[i].i = idx[i];
+  }
+  qsort(order, n, sizeof(corner_response), compare_response_desc);
+
+  // About ANMS_CELL_POINTS corners per cell.
+  int cell = MAX(1, (int)sqrtf((float)R.w * R.h * ANMS_CELL_POINTS /
+                               MAX(n, 1)));
+  int gw = (R.w + cell - 1) / cell, gh = (R.h + cell - 1) / cell;
+  int *head = malloc(gw * gh * sizeof(int));
+  int *next = calloc(MAX(n, 1), sizeof(int));
+  for (int i = 0; i < gw * gh; i++) head[i] = -1;
+
+  top_heap h = make_top_heap(MIN(n, k));
+  int inserted = 0;
+  for (int i = 0; i < n; i++) {
+    int pi = order[i].i;
+    int px = pi % R.w, py = pi / R.w;
+    while (inserted < i && order[inserted].r * ANMS_ROBUST > order[i].r) {
+      int q = order[inserted].i;
+      int c = (q / R.w / cell) * gw + (q % R.w) / cell;
+      next[inserted] = head[c];
+      head[c] = inserted++;
+    }
+
+    float best = FLT_MAX;
+    int cx = px / cell, cy = py / cell;
+    int max_ring = MAX(MAX(cx, gw - 1 - cx), MAX(cy, gh - 1 - cy));
+    for (int ring = 0; inserted > 0 && ring <= max_ring; ring++) {
+      // Corners in this ring are at least ring - 1 cells away.
+      float reach = (float)(ring - 1) * cell;
+      if (ring > 1 && reach * reach >= best) break;
+      for (int gy = cy - ring; gy <= cy + ring; gy++) {
+        if (gy < 0 || gy >= gh) continue;
+        int edge = gy == cy - ring || gy == cy + ring;
+        for (int gx = cx - ring; gx <= cx + ring; gx += edge ? 1 : 2 * ring) {
+          if (gx < 0 || gx >= gw) continue;
+          for (int j = head[gy * gw + gx]; j >= 0; j = next[j]) {
+            int q = order[j].i;
+            float dx = q % R.w - px, dy = q / R.w - py;
+            best = MIN(best, dx * dx + dy * dy);
+          }
         }
       }
     }
+    top_heap_push(&h, best, pi);
   }
-  return r;
+
+  *m = h.n;
+  int *out = calloc(MAX(h.n, 1), sizeof(int));
+  top_heap_drain(&h, out);
+  free_top_heap(h);
+  free(order);
+  free(head);
+  free(next);
+  return out;
+}
+
+// Keep the strongest corners of every cell of a grid, so textured regions
+// cannot use up the whole budget. Each cell also sets its own threshold,
+// GRID_QUALITY times its strongest response, so faint but distinct
+// corners in flat regions survive next to busy ones.
+// image R: response map.
+// int *idx: n candidate indexes into R.
+// int gx, gy: number of cells across and down.
+// int per_cell: corners to keep in each cell.
+// int *m: set to the number kept, at most gx * gy * per_cell.
+// returns: indexes of the kept corners, cell by cell in raster order and
+//          strongest first within a cell.
+int *grid_corners(image R, const int *idx, int n, int gx, int gy,
+                  int per_cell, int *m) {
+  assert(gx > 0 && gy > 0 && per_cell >= 0);
+  int cells = gx * gy;
+  int *cell = calloc(MAX(n, 1), sizeof(int));
+  int *start = calloc(cells + 1, sizeof(int));
+  for (int i = 0; i < n; i++) {
+    int x = idx[i] % R.w, y = idx[i] / R.w;
+    cell[i] = (int)((long)y * gy / R.h) * gx + (int)((long)x * gx / R.w);
+    start[cell[i] + 1]++;
+  }
+  for (int c = 0; c < cells; c++) start[c + 1] += start[c];
+
+  // Counting sort the candidates by cell.
+  int *sorted = calloc(MAX(n, 1), sizeof(int));
+  int *fill = calloc(cells, sizeof(int));
+  for (int i = 0; i < n; i++) {
+    sorted[start[cell[i]] + fill[cell[i]]++] = idx[i];
+  }
+
+  int *out = calloc(MAX(MIN(n, cells * per_cell), 1), sizeof(int));
+  int count = 0;
+  top_heap h = make_top_heap(per_cell);
+  for (int c = 0; c < cells; c++) {
+    float best = -FLT_MAX;
+    for (int i = start[c]; i < start[c + 1]; i++) {
+      best = MAX(best, R.data[sorted[i]]);
+    }
+    float thresh = best * GRID_QUALITY;
+    for (int i = start[c]; i < start[c + 1]; i++) {
+      if (R.data[sorted[i]] >= thresh) {
+        top_heap_push(&h, R.data[sorted[i]], sorted[i]);
+      }
+    }
+    int kept = h.n;
+    top_heap_drain(&h, out + count);
+    count += kept;
+  }
+
+  free_top_heap(h);
+  free(cell);
+  free(start);
+  free(sorted);
+  free(fill);
+  *m = count;
+  return out;
+}
+
+// Shape a grid for CORNERS_GRID: about k / GRID_CELL_CORNERS cells, as
+// close to square as the image allows, and the budget per cell. At most k
+// corners are returned; if the grid would keep more, only the k strongest
+// of them are.
+static int *grid_corners_budget(image R, const int *idx, int n, int k,
+                                int *m) {
+  if (k <= 0) {
+    *m = 0;
+    return calloc(1, sizeof(int));
+  }
+  int cells = MAX(1, k / GRID_CELL_CORNERS);
+  int gx = (int)roundf(sqrtf((float)cells * R.w / R.h));
+  gx = MIN(MAX(gx, 1), cells);
+  int gy = MAX(1, cells / gx);
+  int *out = grid_corners(R, idx, n, gx, gy, MAX(1, k / (gx * gy)), m);
+  if (*m > k) {
+    int *top = top_k_corners(R, out, *m, k, m);
+    free(out);
+    out = top;
+  }
+  return out;
+}
+
+// Detect and describe every Harris corner, a strip of rows per task. Each
+// strip computes its response with a halo of nms rows above and below, so
+// non-max suppression sees the same neighbourhood as on the whole image
+// (harris_strip itself reads the rows the smoothing needs). Strips are
+// concatenated in order, so corners come out in raster order exactly as
+// from nms_candidates on the full response.
+// int *n: set to the number of corners.
+// returns: array of descriptors of the corners.
+static descriptor *harris_corners_tiled(image im, float sigma, float thresh,
+                                        int nms, int *n) {
+  image g = gaussian_kernel(sigma, 1);
+  int strips = (im.h + HARRIS_STRIP_H - 1) / HARRIS_STRIP_H;
+  descriptor **found = calloc(strips, sizeof(descriptor *));
+  int *found_n = calloc(strips, sizeof(int));
+
+  #pragma omp parallel
+  {
+    harris_scratch s = make_harris_scratch(im.w, g.w);
+    #pragma omp for schedule(dynamic)
+    for (int t = 0; t < strips; t++) {
+      int y0 = t * HARRIS_STRIP_H, y1 = MIN(y0 + HARRIS_STRIP_H, im.h);
+      int hy0 = MAX(y0 - nms, 0), hy1 = MIN(y1 + nms, im.h);
+      image T = make_image(im.w, hy1 - hy0, 1);
+      harris_strip(im, g, hy0, hy1, s, T.data);
+
+      int count = 0, kept = 0;
+      int *idx = nms_candidates(T, nms, thresh, &count);
+      descriptor *d = calloc(count, sizeof(descriptor));
+      for (int i = 0; i < count; i++) {
+        int y = idx[i] / im.w + hy0;
+        if (y < y0 || y >= y1) continue;
+        d[kept++] = describe_index(im, idx[i] + hy0 * im.w);
+      }
+      found[t] = d;
+      found_n[t] = kept;
+      free(idx);
+      free_image(T);
+    }
+    free_harris_scratch(s);
+  }
+
+  release_gaussian_kernel(sigma, g);
+
+  int total = 0;
+  for (int t = 0; t < strips; t++) total += found_n[t];
+  descriptor *d = calloc(total, sizeof(descriptor));
+  for (int t = 0, off = 0; t < strips; t++) {
+    memcpy(d + off, found[t], found_n[t] * sizeof(descriptor));
+    off += found_n[t];
+    free(found[t]);
+  }
+  free(found);
+  free(found_n);
+  *n = total;
+  return d;
+}
+
+// Perform harris corner detection and extract features from the corners,
+// keeping a chosen subset of them.
+// image im: input image.
+// float sigma: std. dev for harris.
+// float thresh: threshold for cornerness.
+// int nms: distance to look for local-maxes in response map.
+// CORNERS mode: which of the corners to keep.
+// int k: number of corners for CORNERS_TOP_K and CORNERS_ANMS, and the
+//        total budget for CORNERS_GRID.
+// int *n: pointer to number of corners detected, should fill in.
+// returns: array of descriptors of the corners in the image.
+descriptor *harris_corner_detector_select(image im, float sigma, float thresh,
+                                          int nms, CORNERS mode, int k,
+                                          int *n) {
+  if (mode == CORNERS_ALL) {
+    return harris_corners_tiled(im, sigma, thresh, nms, n);
+  }
+
+  // Calculate structure matrix and estimate cornerness
+  image R = harris_response(im, sigma);
+
+  // Run NMS on the responses
+  int count = 0;
+  int *idx = nms_candidates(R, nms, thresh, &count);
+  int *kept;
+  if (mode == CORNERS_TOP_K) {
+    kept = top_k_corners(R, idx, count, k, &count);
+  } else if (mode == CORNERS_ANMS) {
+    kept = anms_corners(R, idx, count, k, &count);
+  } else {
+    kept = grid_corners_budget(R, idx, count, k, &count);
+  }
+  free(idx);
+  idx = kept;
+
+  *n = count;  // <- set *n equal to number of corners in image.
+  descriptor *d = calloc(count, sizeof(descriptor));
+  for (int i = 0; i < count; i++) {
+    d[i] = describe_index(im, idx[i]);
+  }
+
+  free_image(R);
+  free(idx);
+  return d;
 }
 
 // Perform harris corner detection and extract features from the corners.
@@ -206,34 +848,137 @@ image nms_image(image im, int w) {
 // returns: array of descriptors of the corners in the image.
 descriptor *harris_corner_detector(image im, float sigma, float thresh, int nms,
                                    int *n) {
-  // Calculate structure matrix
-  image S = structure_matrix(im, sigma);
+  return harris_corner_detector_select(im, sigma, thresh, nms, CORNERS_ALL, 0,
+                                       n);
+}
 
-  // Estimate cornerness
-  image R = cornerness_response(S);
+// Halve an image for the next pyramid level, Burt and Adelson's REDUCE:
+// blur with the 5-tap binomial [1 4 6 4 1] / 16 along each axis, evaluated
+// only at the even pixels that are kept. Borders are clamped.
+// image im: image to reduce.
+// returns: image of ceil(w / 2) x ceil(h / 2) pixels.
+static image pyramid_reduce(image im) {
+  static const float taps[5] = {1 / 16., 4 / 16., 6 / 16., 4 / 16., 1 / 16.};
+  int w = (im.w + 1) / 2, h = (im.h + 1) / 2;
+  image result = make_image(w, h, im.c);
 
-  // Run NMS on the responses
-  image Rnms = nms_image(R, nms);
-  int count = 0;  // change this
-  int size = R.c * R.h * R.w;
-  for (int i = 0; i < size; i++) {
-    if (Rnms.data[i] > thresh) {
-      count++;
+  #pragma omp parallel
+  {
+    float *rows = calloc(5 * w, sizeof(float));
+    #pragma omp for
+    for (int t = 0; t < h * im.c; t++) {
+      int c = t / h, y = t % h;
+      const float *chan = im.data + c * im.w * im.h;
+      for (int j = 0; j < 5; j++) {
+        int sy = MIN(MAX(2 * y + j - 2, 0), im.h - 1);
+        const float *src = chan + sy * im.w;
+        float *row = rows + j * w;
+        for (int x = 0; x < w; x++) {
+          float sum = 0;
+          for (int i = 0; i < 5; i++) {
+            sum += taps[i] * src[MIN(MAX(2 * x + i - 2, 0), im.w - 1)];
+          }
+          row[x] = sum;
+        }
+      }
+      float *dst = result.data + c * w * h + y * w;
+      for (int x = 0; x < w; x++) {
+        float sum = 0;
+        for (int j = 0; j < 5; j++) sum += taps[j] * rows[j * w + x];
+        dst[x] = sum;
+      }
     }
+    free(rows);
   }
+  return result;
+}
 
-  *n = count;  // <- set *n equal to number of corners in image.
-  descriptor *d = calloc(count, sizeof(descriptor));
-  count = 0;
-  for (int i = 0; i < size; i++) {
-    if (Rnms.data[i] > thresh) {
-      d[count++] = describe_index(im, i);
+// Perform harris corner detection on an image pyramid. Each level halves
+// the one before it with pyramid_reduce, corners are found on every level
+// with the same sigma, thresh and nms, and a corner is dropped when a corner
+// from a finer level already lies within its NMS window. Descriptors are
+// taken from the level the corner was found on, with p in full-resolution
+// coordinates and scale set to the level's downsampling factor.
+// image im: input image.
+// float sigma: std. dev for harris at each level.
+// float thresh: threshold for cornerness at each level.
+// int nms: distance to look for local-maxes, in pixels of each level.
+// int levels: number of pyramid levels, 1 for full resolution only. No
+//             more are used than it takes to halve the shorter side
+//             down to one pixel.
+// int coarse_only: only search the coarsest level, for quick previews.
+// int *n: pointer to number of corners detected, should fill in.
+// returns: array of descriptors of the corners in the image.
+descriptor *harris_multiscale_detector(image im, float sigma, float thresh,
+                                       int nms, int levels, int coarse_only,
+                                       int *n) {
+  assert(levels > 0);
+  int halvings = 0;
+  for (int s = MIN(im.w, im.h); s > 1; s = (s + 1) / 2) halvings++;
+  levels = MIN(levels, halvings + 1);
+  int count = 0, cap = 64;
+  descriptor *d = calloc(cap, sizeof(descriptor));
+
+  // Kept corners are bucketed by position so duplicates are found by
+  // looking at the neighbouring cells only.
+  float max_radius = MAX(nms, 1) * ldexpf(1, levels - 1);
+  int cell = (int)ceilf(max_radius);
+  int gw = im.w / cell + 1, gh = im.h / cell + 1;
+  int *head = malloc(gw * gh * sizeof(int));
+  int *next = calloc(cap, sizeof(int));
+  for (int i = 0; i < gw * gh; i++) head[i] = -1;
+
+  image level = im;
+  for (int l = 0; l < levels; l++) {
+    float scale = ldexpf(1, l);
+    if (l > 0) {
+      image half = pyramid_reduce(level);
+      if (l > 1) free_image(level);
+      level = half;
+    }
+    if (coarse_only && l < levels - 1) continue;
+
+    image R = harris_response(level, sigma);
+    int m = 0;
+    int *idx = nms_candidates(R, nms, thresh, &m);
+    float radius = MAX(nms, 1) * scale;
+    for (int i = 0; i < m; i++) {
+      point p = make_point(idx[i] % level.w * scale, idx[i] / level.w * scale);
+      int cx = MIN(MAX((int)p.x / cell, 0), gw - 1);
+      int cy = MIN(MAX((int)p.y / cell, 0), gh - 1);
+      int duplicate = 0;
+      for (int gy = MAX(cy - 1, 0); gy <= MIN(cy + 1, gh - 1); gy++) {
+        for (int gx = MAX(cx - 1, 0); gx <= MIN(cx + 1, gw - 1); gx++) {
+          for (int j = head[gy * gw + gx]; j >= 0; j = next[j]) {
+            if (d[j].scale < scale &&
+                fabsf(d[j].p.x - p.x) <= radius &&
+                fabsf(d[j].p.y - p.y) <= radius) {
+              duplicate = 1;
+            }
+          }
+        }
+      }
+      if (duplicate) continue;
+
+      if (count == cap) {
+        cap *= 2;
+        d = realloc(d, cap * sizeof(descriptor));
+        next = realloc(next, cap * sizeof(int));
+      }
+      d[count] = describe_index(level, idx[i]);
+      d[count].p = p;
+      d[count].scale = scale;
+      next[count] = head[cy * gw + cx];
+      head[cy * gw + cx] = count++;
     }
+    free(idx);
+    free_image(R);
   }
+  if (levels > 1) free_image(level);
 
-  free_image(S);
-  free_image(R);
-  free_image(Rnms);
+  free(head);
+  free(next);
+  *n = count;
   return d;
 }
 
@@ -0,0 +1,278 @@
+#include <assert.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "image.h"
+
+// Most descriptors a leaf holds before it is split.
+#define KD_LEAF_SIZE 8
+// Descriptors sampled to estimate the mean and variance at each split.
+#define KD_SAMPLE 128
+// A split dimension is drawn from this many of highest variance.
+#define KD_TOP_DIMS 5
+// Seed of the first tree; tree t uses KD_SEED + t. The forest has its own
+// generator so building one does not disturb rand(), which RANSAC uses.
+#define KD_SEED 0x2545f491u
+
+// An inner node splits on one dimension; a leaf (dim -1) holds count
+// descriptors starting at perm[start].
+typedef struct {
+  int dim;
+  float split;
+  int child[2];
+} kd_node;
+
+struct kd_forest {
+  descriptor_set s;
+  int trees, checks;
+  int *roots;
+  kd_node *nodes;
+  int n_nodes, cap_nodes;
+  int *perm;  // trees x s.n descriptor indexes, leaves point into it.
+};
+
+// A branch not taken yet and a lower bound on its distance.
+typedef struct {
+  float bound;
+  int node;
+} kd_branch;
+
+static uint32_t kd_rand(uint32_t *state) {
+  uint32_t x = *state;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  return *state = x;
+}
+
+static int new_node(kd_forest *f) {
+  if (f->n_nodes == f->cap_nodes) {
+    f->cap_nodes = f->cap_nodes ? 2 * f->cap_nodes : 64;
+    f->nodes = realloc(f->nodes, f->cap_nodes * sizeof(kd_node));
+  }
+  return f->n_nodes++;
+}
+
+// Build the subtree over idx[0..n-1] and return its node. Splits at the
+// sample mean of a dimension picked at random among the KD_TOP_DIMS of
+// highest sample variance, as in Silpa-Anan and Hartley's randomised trees.
+static int build_node(kd_forest *f, int *idx, int n, uint32_t *state) {
+  const descriptor_set *s = &f->s;
+  int node = new_node(f);
+  if (n > KD_LEAF_SIZE) {
+    int dim = s->dim;
+    double *mean = calloc(dim, sizeof(double));
+    double *var = calloc(dim, sizeof(double));
+    int m = MIN(n, KD_SAMPLE);
+    for (int i = 0; i < m; i++) {
+      const float *row = s->data + (size_t)idx[i * n / m] * s->stride;
+      for (int k = 0; k < dim; k++) mean[k] += row[k];
+    }
+    for (int k = 0; k < dim; k++) mean[k] /= m;
+    for (int i = 0; i < m; i++) {
+      const float *row = s->data + (size_t)idx[i * n / m] * s->stride;
+      for (int k = 0; k < dim; k++) {
+        var[k] += (row[k] - mean[k]) * (row[k] - mean[k]);
+      }
+    }
+
+    // Dimensions of highest variance, largest first.
+    int top[KD_TOP_DIMS], ntop = 0;
+    for (int k = 0; k < dim; k++) {
+      int j;
+      if (ntop < KD_TOP_DIMS) {
+        j = ntop++;
+      } else if (var[k] > var[top[KD_TOP_DIMS - 1]]) {
+        j = KD_TOP_DIMS - 1;
+      } else {
+        continue;
+      }
+      for (; j > 0 && var[top[j - 1]] < var[k]; j--) top[j] = top[j - 1];
+      top[j] = k;
+    }
+    int d = top[kd_rand(state) % ntop];
+    float split = mean[d];
+    free(mean);
+    free(var);
+
+    // Partition idx around the split.
+    int lo = 0, hi = n - 1;
+    while (lo <= hi) {
+      if (s->data[(size_t)idx[lo] * s->stride + d] < split) {
+        lo++;
+      } else {
+        int t = idx[lo];
+        idx[lo] = idx[hi];
+        idx[hi--] = t;
+      }
+    }
+    if (lo > 0 && lo < n) {
+      int left = build_node(f, idx, lo, state);
+      int right = build_node(f, idx + lo, n - lo, state);
+      f->nodes[node].dim = d;
+      f->nodes[node].split = split;
+      f->nodes[node].child[0] = left;
+      f->nodes[node].child[1] = right;
+      return node;
+    }
+    // The sample could not separate these; keep them in one leaf.
+  }
+  f->nodes[node].dim = -1;
+  f->nodes[node].child[0] = idx - f->perm;
+  f->nodes[node].child[1] = n;
+  return node;
+}
+
+// Build a randomised k-d forest over a descriptor set, for approximate
+// nearest neighbour queries with kd_nearest_two. Build once per image and
+// query it from every image it is matched against.
+// descriptor_set s: descriptors to index. Not copied: keep it alive and
+//                   unchanged while the forest is used.
+// int trees: number of randomised trees, e.g. 4. More trees find the true
+//            nearest neighbour more often for the same checks. At least 1
+//            tree is built.
+// int checks: descriptors compared per query before the search stops,
+//             e.g. 64. Higher is slower and more accurate; s.n or more
+//             makes the search exact. Raised to 1 if lower.
+// returns: the forest, free with free_kd_forest.
+kd_forest *make_kd_forest(descriptor_set s, int trees, int checks) {
+  trees = MAX(trees, 1);
+  checks = MAX(checks, 1);
+  kd_forest *f = calloc(1, sizeof(kd_forest));
+  f->s = s;
+  f->trees = trees;
+  f->checks = checks;
+  f->roots = calloc(trees, sizeof(int));
+  f->perm = calloc((size_t)trees * MAX(s.n, 1), sizeof(int));
+  for (int t = 0; t < trees; t++) {
+    int *idx = f->perm + (size_t)t * s.n;
+    for (int i = 0; i < s.n; i++) idx[i] = i;
+    uint32_t state = KD_SEED + t;
+    f->roots[t] = build_node(f, idx, s.n, &state);
+  }
+  return f;
+}
+
+void free_kd_forest(kd_forest *f) {
+  if (!f) return;
+  free(f->roots);
+  free(f->nodes);
+  free(f->perm);
+  free(f);
+}
+
+static void heap_push(kd_branch **h, int *n, int *cap, float bound, int node) {
+  if (*n == *cap) {
+    *cap *= 2;
+    *h = realloc(*h, *cap * sizeof(kd_branch));
+  }
+  kd_branch *a = *h;
+  int i = (*n)++;
+  while (i > 0 && a[(i - 1) / 2].bound > bound) {
+    a[i] = a[(i - 1) / 2];
+    i = (i - 1) / 2;
+  }
+  a[i].bound = bound;
+  a[i].node = node;
+}
+
+static kd_branch heap_pop(kd_branch *a, int *n) {
+  kd_branch top = a[0], last = a[--(*n)];
+  int i = 0;
+  while (1) {
+    int c = 2 * i + 1;
+    if (c >= *n) break;
+    if (c + 1 < *n && a[c + 1].bound < a[c].bound) c++;
+    if (a[c].bound >= last.bound) break;
+    a[i] = a[c];
+    i = c;
+  }
+  if (*n > 0) a[i] = last;
+  return top;
+}
+
+static inline float row_distance(const float *a, const float *b, int stride,
+                                 int l2) {
+  float s = 0;
+  if (l2) {
+    for (int k = 0; k < stride; k++) s += (a[k] - b[k]) * (a[k] - b[k]);
+  } else {
+    for (int k = 0; k < stride; k++) s += fabsf(a[k] - b[k]);
+  }
+  return s;
+}
+
+// Approximate nearest and second nearest neighbours of every query by
+// best-bin-first search (Beis and Lowe) over all trees at once: descend
+// each tree to a leaf, queue the branches passed over by a lower bound on
+// their distance, and keep expanding the closest queued branch until the
+// forest's checks budget of descriptors has been compared. Descriptors
+// reached through several trees are only compared once.
+// kd_forest *f: index over the set to search.
+// descriptor_set q: queries, of the same dim as the indexed set.
+// DISTANCE metric: DISTANCE_L1 or DISTANCE_L2.
+// int *best, float *d1, float *d2: as from nearest_two.
+void kd_nearest_two(kd_forest *f, descriptor_set q, DISTANCE metric,
+                    int *best, float *d1, float *d2) {
+  const descriptor_set *s = &f->s;
+  assert(q.n == 0 || s->n == 0 || q.dim == s->dim);
+  int l2 = metric == DISTANCE_L2;
+
+  #pragma omp parallel
+  {
+    int cap = 64, nh = 0;
+    kd_branch *heap = malloc(cap * sizeof(kd_branch));
+    int *seen = calloc(MAX(s->n, 1), sizeof(int));
+    #pragma omp for schedule(dynamic, 16)
+    for (int j = 0; j < q.n; j++) {
+      const float *query = q.data + (size_t)j * q.stride;
+      float m1 = __FLT_MAX__, m2 = __FLT_MAX__;
+      int bi = 0, checked = 0;
+      nh = 0;
+      for (int t = 0; t < f->trees; t++) {
+        heap_push(&heap, &nh, &cap, 0, f->roots[t]);
+      }
+
+      while (nh > 0 && (checked < f->checks || m1 == __FLT_MAX__)) {
+        kd_branch br = heap_pop(heap, &nh);
+        if (br.bound >= m2) continue;
+        const kd_node *node = f->nodes + br.node;
+        while (node->dim >= 0) {
+          float diff = query[node->dim] - node->split;
+          int near = diff >= 0;
+          float bound = l2 ? diff * diff : fabsf(diff);
+          if (bound < m2) {
+            heap_push(&heap, &nh, &cap, MAX(br.bound, bound),
+                      node->child[!near]);
+          }
+          node = f->nodes + node->child[near];
+        }
+        const int *idx = f->perm + node->child[0];
+        for (int k = 0; k < node->child[1]; k++) {
+          int i = idx[k];
+          // Stamp by query so the array never needs clearing.
+          if (seen[i] == j + 1) continue;
+          seen[i] = j + 1;
+          checked++;
+          float dis = row_distance(query, s->data + (size_t)i * s->stride,
+                                   s->stride, l2);
+          if (dis < m1 || (dis == m1 && i < bi)) {
+            m2 = m1;
+            m1 = dis;
+            bi = i;
+          } else if (dis < m2) {
+            m2 = dis;
+          }
+        }
+      }
+      best[j] = bi;
+      d1[j] = l2 && m1 < __FLT_MAX__ ? sqrtf(m1) : m1;
+      d2[j] = l2 && m2 < __FLT_MAX__ ? sqrtf(m2) : m2;
+    }
+    free(heap);
+    free(seen);
+  }
+}
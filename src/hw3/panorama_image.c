@@ -7,6 +7,11 @@
 #include "image.h"
 #include "matrix.h"
 
+// match_descriptors compares the arrays pair by pair up to this many
+// pairs. Past it, packing both into descriptor sets is paid back by the
+// blocked matcher.
+#define MATCH_DIRECT_PAIRS 128
+
 // Comparator for matches
 // const void *a, *b: pointers to the matches to compare.
 // returns: result of comparison, 0 if same, 1 if a > b, -1 if a < b.
@@ -112,7 +117,9 @@ image find_and_draw_matches(image a, image b, float sigma, float thresh,
   return lines;
 }
 
-// Calculates L1 distance between to floating point arrays.
+// Calculates L1 distance between to floating point arrays. This is the
+// scalar reference for the blocked matcher, and what match_descriptors
+// uses for inputs too small to be worth packing.
 // float *a, *b: arrays to compare.
 // int n: number of values in each array.
 // returns: l1 distance between arrays (sum of absolute differences).
@@ -124,7 +131,33 @@ float l1_distance(float *a, float *b, int n) {
   return dis;
 }
 
-// Finds best matches between descriptors of two images.
+// Sort matches by distance and drop all but the best match to each point
+// of the second image, so the result is one-to-one.
+// match *m: matches to filter, in place.
+// int n: number of matches.
+// int bn: number of points in the second image.
+// returns: number of matches kept at the front of m.
+int unique_matches(match *m, int n, int bn) {
+  int count = 0;
+  int8_t *seen = calloc(bn, sizeof(int8_t));
+  qsort((void *)m, n, sizeof(m[0]), match_compare);
+  for (int i = 0; i < n; i++) {
+    if (!seen[m[i].bi]) {
+      seen[m[i].bi] = 1;
+      m[count++] = m[i];
+    }
+  }
+  free(seen);
+  return count;
+}
+
+// Finds best matches between descriptors of two images by L1 distance.
+// Up to MATCH_DIRECT_PAIRS pairs are compared straight from the arrays.
+// Larger inputs are copied into descriptor sets, which costs O((an + bn) *
+// n) against the O(an * bn * n) of matching, and compared by the blocked
+// matcher of match_descriptor_sets with no ratio test. Callers matching
+// an image many times can keep its set, or a k-d forest over it, and call
+// match_descriptor_sets themselves.
 // descriptor *a, *b: array of descriptors for pixels in two images.
 // int an, bn: number of descriptors in arrays a and b.
 // int *mn: pointer to number of matches found, to be filled in by function.
@@ -132,40 +165,36 @@ float l1_distance(float *a, float *b, int n) {
 //          one other descriptor in b.
 match *match_descriptors(descriptor *a, int an, descriptor *b, int bn,
                          int *mn) {
-  int i, j;
-
-  // We will have at most an matches.
-  *mn = an;
-  int data_n = an > 0 ? a[0].n : 0;
-  match *m = calloc(an, sizeof(match));
-  for (j = 0; j < an; ++j) {
-    float min_dis = __FLT_MAX__;
-    int bind = 0;  // <- find the best match
-    for (i = 0; i < bn; i++) {
-      float dis = l1_distance(a[j].data, b[i].data, data_n);
-      if (dis < min_dis) {
-        min_dis = dis;
-        bind = i;
-      }
+  if ((long)an * bn <= MATCH_DIRECT_PAIRS) {
+    match *m = calloc(MAX(an, 1), sizeof(match));
+    if (bn == 0) {
+      *mn = 0;
+      return m;
     }
-    m[j].ai = j;
-    m[j].bi = bind;  // <- should be index in b.
-    m[j].p = a[j].p;
-    m[j].q = b[bind].p;
-    m[j].distance = min_dis;  // <- should be the smallest L1 distance!
-  }
-
-  int count = 0;
-  int8_t *seen = calloc(bn, sizeof(int8_t));
-  qsort((void *)m, an, sizeof(m[0]), match_compare);
-  for (i = 0; i < an; i++) {
-    if (!seen[m[i].bi]) {
-      seen[m[i].bi] = 1;
-      m[count++] = m[i];
+    for (int j = 0; j < an; ++j) {
+      float min_dis = __FLT_MAX__;
+      int bind = 0;
+      for (int i = 0; i < bn; i++) {
+        float dis = l1_distance(a[j].data, b[i].data, a[j].n);
+        if (dis < min_dis) {
+          min_dis = dis;
+          bind = i;
+        }
+      }
+      m[j].ai = j;
+      m[j].bi = bind;
+      m[j].p = a[j].p;
+      m[j].q = b[bind].p;
+      m[j].distance = min_dis;
     }
+    *mn = unique_matches(m, an, bn);
+    return m;
   }
-  *mn = count;
-  free(seen);
+  descriptor_set as = descriptors_to_set(a, an);
+  descriptor_set bs = descriptors_to_set(b, bn);
+  match *m = match_descriptor_sets(as, bs, DISTANCE_L1, 1, 0, mn);
+  free_descriptor_set(as);
+  free_descriptor_set(bs);
   return m;
 }
 
@@ -74,38 +74,19 @@ image make_integral_image(image im) {
   return integ;
 }
 
-float box_filter_pixel(image integ, int x, int y, int channel, int padding) {
-  int x1 = (++x) - padding;
-  int x2 = x + padding;
-  int y1 = (++y) - padding;
-  int y2 = y + padding;
-  return get_pixel(integ, x2, y2, channel) -
-         get_pixel(integ, x1 - 1, y2, channel) -
-         get_pixel(integ, x2, y1 - 1, channel) +
-         get_pixel(integ, x1 - 1, y1 - 1, channel);
-}
-
-// Apply a box filter to an image using an integral image for speed
+// Apply a box filter to an image using running sums for speed. The window
+// is the one the integral-image version summed, 2 * ((s - 1) / 2) + 1 pixels
+// wide, so an even s sums s - 1 pixels; the sum is still divided by s * s.
 // image im: image to smooth
 // int s: window size for box filter
-// returns: smoothed image
+// returns: smoothed image, with pixels outside im counted as 0
 image box_filter_image(image im, int s) {
-  int x, y, channel;
-  int padding = (s - 1) / 2;
-  float value;
-  image integ = make_integral_image(im);
-  image S = make_image(im.w, im.h, im.c);
-
-  float div = s * s;
-  for (channel = 0; channel < im.c; channel++) {
-    for (y = 0; y < im.h; y++) {
-      for (x = 0; x < im.w; x++) {
-        value = box_filter_pixel(integ, x, y, channel, padding);
-        set_pixel(S, x, y, channel, value / div);
-      }
-    }
+  int w = 2 * ((s - 1) / 2) + 1;
+  image S = box_blur_image(im, w, BORDER_CONSTANT, 0);
+  if (w != s) {
+    float rescale = (float)(w * w) / (s * s);
+    for (int i = 0; i < S.w * S.h * S.c; i++) S.data[i] *= rescale;
   }
-  free_image(integ);
   return S;
 }
 
@@ -125,12 +106,12 @@ image time_structure_matrix(image im, image prev, int s) {
   }
 
   image Is = make_image(im.w, im.h, 5);
-  image gx_filter = make_gx_filter();
-  image gy_filter = make_gy_filter();
-  image Ix = convolve_image(im, gx_filter, 0);
-  image Iy = convolve_image(im, gy_filter, 0);
-  free_image(gx_filter);
-  free_image(gy_filter);
+  image filters[2] = {make_gx_filter(), make_gy_filter()};
+  image grads[2];
+  convolve_filter_bank(im, filters, 2, grads, 0);
+  image Ix = grads[0], Iy = grads[1];
+  free_image(filters[0]);
+  free_image(filters[1]);
 
   int size = im.h * im.w;
   for (i = 0; i < size; i++) {
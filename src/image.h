@@ -29,12 +29,41 @@ typedef struct{
 // point p: x,y coordinates of the image pixel.
 // int n: the number of floating point values in the descriptor.
 // float *data: the descriptor for the pixel.
+// float scale: pyramid scale it was detected at, 1 for full resolution.
 typedef struct{
     point p;
     int n;
     float *data;
+    float scale;
 } descriptor;
 
+// Descriptors stored structure-of-arrays, for code that streams through
+// many of them. Row i of data holds descriptor i and starts at
+// data + i * stride; rows are 32-byte aligned and zero padded.
+// int n: the number of descriptors.
+// int dim: the number of floating point values in each descriptor.
+// int stride: floats from one row to the next, dim rounded up.
+// point *p: n coordinates.
+// float *scale: n pyramid scales.
+// float *data: n x stride descriptor values.
+typedef struct{
+    int n, dim, stride;
+    point *p;
+    float *scale;
+    float *data;
+} descriptor_set;
+
+// A binary descriptor for a point in an image, one bit per BRIEF test.
+// point p: x,y coordinates of the image pixel.
+// float scale: pyramid scale it was detected at, 1 for full resolution.
+// unsigned long long bits: the 256 test results.
+#define BRIEF_WORDS 4
+typedef struct{
+    point p;
+    float scale;
+    unsigned long long bits[BRIEF_WORDS];
+} binary_descriptor;
+
 // A match between two points in an image.
 // point p, q: x,y coordinates of the two matching pixels.
 // int ai, bi: indexes in the descriptor array. For eliminating duplicates.
@@ -77,20 +106,91 @@ float bilinear_interpolate(image im, float x, float y, int c);
 image bilinear_resize(image im, int w, int h);
 
 // Filtering
+
+// How filters read pixels outside the image.
+// BORDER_CLAMP: repeat the edge pixel (same as get_pixel).
+// BORDER_REFLECT: mirror about the edge pixel, dcb|abcd|cba.
+// BORDER_WRAP: tile the image periodically.
+// BORDER_CONSTANT: use a fixed value.
+typedef enum{BORDER_CLAMP, BORDER_REFLECT, BORDER_WRAP, BORDER_CONSTANT} BORDER;
+
+int border_index(int i, int n, BORDER border);
 image convolve_image(image im, image filter, int preserve);
+image convolve_image_border(image im, image filter, int preserve, BORDER border, float value);
+void convolve_filter_bank(image im, image *filters, int n, image *outs, int preserve);
+image fft_convolve_image(image im, image filter, int preserve);
+image fft_convolve_image_border(image im, image filter, int preserve, BORDER border, float value);
 image make_box_filter(int w);
 image make_highpass_filter();
 image make_sharpen_filter();
 image make_emboss_filter();
 image make_gaussian_filter(float sigma);
+image gaussian_kernel(float sigma, int separable);
+void release_gaussian_kernel(float sigma, image k);
 image make_gx_filter();
 image make_gy_filter();
+
+// Fixed filters with specialised stencils, see named_filter_image.
+typedef enum{FILTER_HIGHPASS, FILTER_SHARPEN, FILTER_EMBOSS, FILTER_GX, FILTER_GY, FILTER_BINOMIAL5, FILTER_LAPLACIAN5} FILTER;
+
+image make_named_filter(FILTER f);
+image named_filter_image(image im, FILTER f, int preserve);
+
+// 8-bit images and fixed-point convolution
+typedef struct{
+    int w,h,c;
+    unsigned char *data;
+} image_u8;
+
+image_u8 make_image_u8(int w, int h, int c);
+void free_image_u8(image_u8 im);
+image_u8 image_to_u8(image im);
+image u8_to_image(image_u8 im);
+image_u8 convolve_image_u8(image_u8 im, image filter, int shift, int offset);
+
+// Denoising
+image median_image(image im, int r);
+image bilateral_image(image im, float sigma_s, float sigma_r);
+
 void feature_normalize(image im);
 void l1_normalize(image im);
 void threshold_image(image im, float thresh);
 image *sobel_image(image im);
+void sobel_gradients(image im, image gx, image gy, image mag, image theta, int approx);
 image colorize_sobel(image im);
+image make_1d_gaussian(float sigma);
 image smooth_image(image im, float sigma);
+image unsharp_mask(image im, float sigma, float amount, float threshold);
+
+// How smooth_image_method computes a Gaussian blur.
+// SMOOTH_AUTO: pick based on sigma, see smooth_image_method.
+// SMOOTH_DIRECT: one 2d kernel.
+// SMOOTH_SEPARABLE: two 1d kernels.
+// SMOOTH_RECURSIVE: recursive filter, cost independent of sigma.
+// SMOOTH_BOX: three running-sum box filters, a cheap approximation.
+typedef enum{SMOOTH_AUTO, SMOOTH_DIRECT, SMOOTH_SEPARABLE, SMOOTH_RECURSIVE, SMOOTH_BOX} SMOOTH;
+
+image smooth_image_method(image im, float sigma, SMOOTH method);
+image recursive_gaussian_image(image im, float sigma);
+image box_blur_image(image im, int w, BORDER border, float value);
+image iterated_box_image(image im, float sigma, int passes);
+
+// Scale space
+// A stack of increasingly blurred copies of an image.
+// int n: number of levels.
+// float *sigmas: blur of each level.
+// image *levels: blurred images, levels[i] blurred by sigmas[i].
+typedef struct{
+    int n;
+    float *sigmas;
+    image *levels;
+} scale_space;
+
+scale_space make_scale_space(image im, const float *sigmas, int n);
+scale_space make_geometric_scale_space(image im, float sigma0, float k, int n);
+void free_scale_space(scale_space s);
+image dog_image(scale_space s, int i);
+void frequency_split(image im, float sigma, image *low, image *high);
 
 // Harris and Stitching
 point make_point(float x, float y);
@@ -98,18 +198,62 @@ point project_point(matrix H, point p);
 matrix compute_homography(match *matches, int n);
 image structure_matrix(image im, float sigma);
 image cornerness_response(image S);
+image harris_response(image im, float sigma);
+image max_filter_image(image im, int w);
+image nms_image(image im, int w);
+int *nms_candidates(image im, int w, float thresh, int *n);
 void free_descriptors(descriptor *d, int n);
+descriptor describe_index(image im, int i);
+descriptor_set make_descriptor_set(int n, int dim);
+void free_descriptor_set(descriptor_set s);
+descriptor_set descriptors_to_set(descriptor *d, int n);
+descriptor *set_to_descriptors(descriptor_set s);
 image cylindrical_project(image im, float f);
 void mark_corners(image im, descriptor *d, int n);
 image find_and_draw_matches(image a, image b, float sigma, float thresh, int nms);
 void detect_and_draw_corners(image im, float sigma, float thresh, int nms);
 int model_inliers(matrix H, match *m, int n, float thresh);
 image combine_images(image a, image b, matrix H);
+float l1_distance(float *a, float *b, int n);
 match *match_descriptors(descriptor *a, int an, descriptor *b, int bn, int *mn);
+int unique_matches(match *m, int n, int bn);
+
+// Distance between descriptors for the matchers.
+// DISTANCE_L1: sum of absolute differences.
+// DISTANCE_L2: Euclidean distance.
+typedef enum{DISTANCE_L1, DISTANCE_L2} DISTANCE;
+
+// Randomised k-d forest over a descriptor set, see make_kd_forest.
+typedef struct kd_forest kd_forest;
+
+void nearest_two(descriptor_set a, descriptor_set b, DISTANCE metric, int *best, float *d1, float *d2);
+kd_forest *make_kd_forest(descriptor_set s, int trees, int checks);
+void free_kd_forest(kd_forest *f);
+void kd_nearest_two(kd_forest *f, descriptor_set q, DISTANCE metric, int *best, float *d1, float *d2);
+match *match_descriptor_sets(descriptor_set a, descriptor_set b, DISTANCE metric, float ratio, kd_forest *index, int *mn);
+binary_descriptor *brief_descriptors(image im, descriptor *d, int n);
+int hamming_distance(binary_descriptor *a, binary_descriptor *b);
+match *match_binary_descriptors(binary_descriptor *a, int an, binary_descriptor *b, int bn, int *mn);
 descriptor *harris_corner_detector(image im, float sigma, float thresh, int nms, int *n);
+
+// Which corners harris_corner_detector_select keeps.
+// CORNERS_ALL: every local maximum above the threshold.
+// CORNERS_TOP_K: the k strongest.
+// CORNERS_ANMS: k well spread corners, by adaptive non-maximal suppression.
+// CORNERS_GRID: about k corners, the strongest of each cell of a grid.
+typedef enum{CORNERS_ALL, CORNERS_TOP_K, CORNERS_ANMS, CORNERS_GRID} CORNERS;
+
+descriptor *harris_multiscale_detector(image im, float sigma, float thresh, int nms, int levels, int coarse_only, int *n);
+descriptor *harris_corner_detector_select(image im, float sigma, float thresh, int nms, CORNERS mode, int k, int *n);
+int *top_k_corners(image R, const int *idx, int n, int k, int *m);
+int *anms_corners(image R, const int *idx, int n, int k, int *m);
+int *grid_corners(image R, const int *idx, int n, int gx, int gy, int per_cell, int *m);
+image fast_response(image im, int arc, float thresh);
+descriptor *fast_corner_detector(image im, int arc, float thresh, int nms, int *n);
 image panorama_image(image a, image b, float sigma, float thresh, int nms, float inlier_thresh, int iters, int cutoff);
 
 // Optical Flow
+image box_filter_image(image im, int s);
 image optical_flow_images(image im, image prev, int smooth, int stride);
 void optical_flow_webcam(int smooth, int stride, int div);
 void draw_flow(image im, image v, float scale);
@@ -2,6 +2,7 @@
 #include <math.h>
 #include <string.h>
 #include <assert.h>
+#include <float.h>
 #include "matrix.h"
 #include "image.h"
 #include "test.h"
@@ -377,6 +378,89 @@ void test_frequency_image(){
     free_image(high_freq);
 }
 
+void test_fft_convolution(){
+    image im = load_image("data/dog.jpg");
+    image f = make_gaussian_filter(2);
+    image blur = fft_convolve_image(im, f, 1);
+    clamp_image(blur);
+    image gt = load_image("figs/dog-gauss2.png");
+    TEST(same_image(blur, gt));
+    free_image(f);
+    free_image(blur);
+    free_image(gt);
+
+    f = make_highpass_filter();
+    blur = fft_convolve_image(im, f, 0);
+    clamp_image(blur);
+    gt = load_image("figs/dog-highpass.png");
+    TEST(same_image(blur, gt));
+    free_image(f);
+    free_image(blur);
+    free_image(gt);
+
+    // Non-square, multi-channel filter against the direct path.
+    f = make_image(5, 9, 3);
+    int i;
+    for(i = 0; i < f.w*f.h*f.c; ++i) f.data[i] = (i % 7 - 3) / 20.0;
+    image direct = convolve_image(im, f, 0);
+    blur = fft_convolve_image(im, f, 0);
+    TEST(same_image(blur, direct));
+    free_image(im);
+    free_image(f);
+    free_image(blur);
+    free_image(direct);
+}
+
+float border_pixel(image im, int x, int y, int c, BORDER border, float value)
+{
+    int bx = border_index(x, im.w, border);
+    int by = border_index(y, im.h, border);
+    if(bx < 0 || by < 0) return value;
+    return im.data[c*im.w*im.h + by*im.w + bx];
+}
+
+void test_convolution_border(){
+    TEST(border_index(-1, 5, BORDER_CLAMP) == 0);
+    TEST(border_index(6, 5, BORDER_CLAMP) == 4);
+    TEST(border_index(-2, 5, BORDER_REFLECT) == 2);
+    TEST(border_index(5, 5, BORDER_REFLECT) == 3);
+    TEST(border_index(-1, 5, BORDER_WRAP) == 4);
+    TEST(border_index(7, 5, BORDER_WRAP) == 2);
+    TEST(border_index(-1, 5, BORDER_CONSTANT) == -1);
+
+    image im = load_image("data/dogsmall.jpg");
+    image f = make_image(5, 3, 1);
+    int i, x, y, c, fx, fy;
+    for(i = 0; i < f.w*f.h; ++i) f.data[i] = (i % 5 - 2) / 10.0;
+    BORDER modes[] = {BORDER_REFLECT, BORDER_WRAP, BORDER_CONSTANT};
+    for(i = 0; i < 3; ++i){
+        image conv = convolve_image_border(im, f, 1, modes[i], .5);
+        image gt = make_image(im.w, im.h, im.c);
+        for(c = 0; c < im.c; ++c){
+            for(y = 0; y < im.h; ++y){
+                for(x = 0; x < im.w; ++x){
+                    float sum = 0;
+                    for(fy = 0; fy < f.h; ++fy){
+                        for(fx = 0; fx < f.w; ++fx){
+                            sum += f.data[fy*f.w + fx] *
+                                border_pixel(im, x + fx - 2, y + fy - 1, c, modes[i], .5);
+                        }
+                    }
+                    set_pixel(gt, x, y, c, sum);
+                }
+            }
+        }
+        image fft = fft_convolve_image_border(im, f, 1, modes[i], .5);
+        TEST(same_image(conv, gt));
+        TEST(same_image(fft, gt));
+        free_image(conv);
+        free_image(fft);
+        free_image(gt);
+    }
+    free_image(im);
+    free_image(f);
+}
+
 void test_sobel(){
     image im = load_image("data/dog.jpg");
     image *res = sobel_image(im);
@@ -415,6 +499,344 @@ void test_sobel(){
     free(res);
 }
 
+float max_image_diff(image a, image b)
+{
+    int i;
+    float diff = 0;
+    for(i = 0; i < a.w*a.h*a.c; ++i){
+        diff = MAX(diff, fabsf(a.data[i] - b.data[i]));
+    }
+    return diff;
+}
+
+void test_smooth_methods()
+{
+    image im = load_image("data/dog.jpg");
+    image direct = smooth_image_method(im, 2, SMOOTH_DIRECT);
+    image sep = smooth_image_method(im, 2, SMOOTH_SEPARABLE);
+    TEST(same_image(sep, direct));
+    free_image(direct);
+    free_image(sep);
+
+    // The recursive filter approximates the Gaussian to within about 1%.
+    sep = smooth_image_method(im, 8, SMOOTH_SEPARABLE);
+    image rec = smooth_image_method(im, 8, SMOOTH_RECURSIVE);
+    TEST(rec.w == sep.w && rec.h == sep.h && rec.c == sep.c);
+    TEST(max_image_diff(rec, sep) < .01);
+    free_image(sep);
+    free_image(rec);
+    free_image(im);
+}
+
+void test_box_blur()
+{
+    image im = load_image("data/dog.jpg");
+    image blur = box_blur_image(im, 7, BORDER_CLAMP, 0);
+    clamp_image(blur);
+    image gt = load_image("figs/dog-box7.png");
+    TEST(same_image(blur, gt));
+    free_image(blur);
+    free_image(gt);
+
+    image f = make_box_filter(6);
+    blur = box_blur_image(im, 6, BORDER_CONSTANT, .25);
+    gt = convolve_image_border(im, f, 1, BORDER_CONSTANT, .25);
+    TEST(same_image(blur, gt));
+    free_image(f);
+    free_image(blur);
+    free_image(gt);
+
+    // Three box passes are a rough Gaussian; the worst pixels sit on sharp
+    // edges where the kernel tails differ most.
+    blur = smooth_image_method(im, 4, SMOOTH_BOX);
+    gt = smooth_image_method(im, 4, SMOOTH_SEPARABLE);
+    TEST(max_image_diff(blur, gt) < .1);
+    free_image(blur);
+    free_image(gt);
+    free_image(im);
+}
+
+void test_sobel_gradients()
+{
+    image im = load_image("data/dog.jpg");
+    image gxf = make_gx_filter();
+    image gyf = make_gy_filter();
+    image gx_gt = convolve_image(im, gxf, 0);
+    image gy_gt = convolve_image(im, gyf, 0);
+    image gx = make_image(im.w, im.h, 1);
+    image gy = make_image(im.w, im.h, 1);
+    image mag = make_image(im.w, im.h, 1);
+    image theta = make_image(im.w, im.h, 1);
+    sobel_gradients(im, gx, gy, mag, theta, 0);
+    TEST(same_image(gx, gx_gt));
+    TEST(same_image(gy, gy_gt));
+
+    image fmag = make_image(im.w, im.h, 1);
+    image ftheta = make_image(im.w, im.h, 1);
+    image none = {0};
+    sobel_gradients(im, none, none, fmag, ftheta, 1);
+    int i;
+    float merr = 0, terr = 0;
+    for(i = 0; i < im.w*im.h; ++i){
+        merr = MAX(merr, fabsf(fmag.data[i] - mag.data[i]) / (mag.data[i] + 1e-3));
+        terr = MAX(terr, fabsf(ftheta.data[i] - theta.data[i]));
+    }
+    TEST(merr < .005);
+    TEST(terr < .005);
+
+    free_image(im);
+    free_image(gxf);
+    free_image(gyf);
+    free_image(gx_gt);
+    free_image(gy_gt);
+    free_image(gx);
+    free_image(gy);
+    free_image(mag);
+    free_image(theta);
+    free_image(fmag);
+    free_image(ftheta);
+}
+
+void test_named_filters()
+{
+    image im = load_image("data/dog.jpg");
+    int f, preserve;
+    for(f = FILTER_HIGHPASS; f <= FILTER_LAPLACIAN5; ++f){
+        image filter = make_named_filter(f);
+        for(preserve = 0; preserve <= 1; ++preserve){
+            image fast = named_filter_image(im, f, preserve);
+            image gt = convolve_image(im, filter, preserve);
+            TEST(same_image(fast, gt));
+            free_image(fast);
+            free_image(gt);
+        }
+        free_image(filter);
+    }
+    free_image(im);
+}
+
+void test_filter_bank()
+{
+    image im = load_image("data/dog.jpg");
+    image filters[5] = {make_gx_filter(), make_gy_filter(),
+        make_named_filter(FILTER_LAPLACIAN5), make_box_filter(4),
+        make_gaussian_filter(3)};
+    image outs[5];
+    int i, preserve;
+    for(preserve = 0; preserve <= 1; ++preserve){
+        convolve_filter_bank(im, filters, 5, outs, preserve);
+        for(i = 0; i < 5; ++i){
+            image gt = convolve_image(im, filters[i], preserve);
+            TEST(same_image(outs[i], gt));
+            free_image(gt);
+            free_image(outs[i]);
+        }
+    }
+    for(i = 0; i < 5; ++i) free_image(filters[i]);
+    free_image(im);
+}
+
+int compare_floats(const void *a, const void *b)
+{
+    float fa = *(const float *)a, fb = *(const float *)b;
+    return (fa > fb) - (fa < fb);
+}
+
+void test_median_filter()
+{
+    image dog = load_image("data/dog.jpg");
+    image im = bilinear_resize(dog, 83, 61);
+    int r, x, y, c, i, j;
+    float window[23*23];
+    for(r = 1; r <= 11; r += 5){
+        image med = median_image(im, r);
+        int ok = 1;
+        for(c = 0; c < im.c; ++c){
+            for(y = 0; y < im.h; ++y){
+                for(x = 0; x < im.w; ++x){
+                    int n = 0;
+                    for(j = -r; j <= r; ++j){
+                        for(i = -r; i <= r; ++i){
+                            window[n++] = roundf(get_pixel(im, x+i, y+j, c)*255);
+                        }
+                    }
+                    qsort(window, n, sizeof(float), compare_floats);
+                    if(fabsf(get_pixel(med, x, y, c) - window[n/2]/255) > 1e-5) ok = 0;
+                }
+            }
+        }
+        TEST(ok);
+        free_image(med);
+    }
+    free_image(dog);
+    free_image(im);
+}
+
+void test_bilateral_filter()
+{
+    // A noisy step: the filter should remove the noise but keep the step.
+    image im = make_image(64, 64, 1);
+    int x, y;
+    srand(1);
+    for(y = 0; y < im.h; ++y){
+        for(x = 0; x < im.w; ++x){
+            float noise = .04*((float)rand()/RAND_MAX - .5);
+            set_pixel(im, x, y, 0, (x < 32 ? .2 : .8) + noise);
+        }
+    }
+    image out = bilateral_image(im, 4, .1);
+    float err = 0;
+    for(y = 0; y < im.h; ++y){
+        for(x = 0; x < im.w; ++x){
+            err = MAX(err, fabsf(get_pixel(out, x, y, 0) - (x < 32 ? .2 : .8)));
+        }
+    }
+    TEST(err < .02);
+    free_image(im);
+    free_image(out);
+}
+
+void test_u8_convolution()
+{
+    image dog = load_image("data/dog.jpg");
+    image_u8 im = image_to_u8(dog);
+    image gx = make_gx_filter();
+    image sharpen = make_sharpen_filter();
+    image box = make_box_filter(3);
+
+    // Integer filters are exact, up to saturation of the output.
+    image_u8 out = convolve_image_u8(im, gx, 0, 128);
+    image fim = u8_to_image(im);
+    image gt = convolve_image(fim, gx, 1);
+    int i, ok = 1;
+    for(i = 0; i < gt.w*gt.h*gt.c; ++i){
+        int v = (int)roundf(gt.data[i]*255) + 128;
+        if(out.data[i] != MIN(MAX(v, 0), 255)) ok = 0;
+    }
+    TEST(ok);
+    free_image_u8(out);
+    free_image(gt);
+
+    out = convolve_image_u8(im, sharpen, 0, 0);
+    gt = convolve_image(fim, sharpen, 1);
+    clamp_image(gt);
+    image res = u8_to_image(out);
+    TEST(same_image(res, gt));
+    free_image_u8(out);
+    free_image(gt);
+    free_image(res);
+
+    // Box taps are rounded to 1/128ths.
+    out = convolve_image_u8(im, box, 7, 0);
+    gt = convolve_image(fim, box, 1);
+    res = u8_to_image(out);
+    TEST(max_image_diff(res, gt) < .02);
+    free_image_u8(out);
+    free_image(gt);
+    free_image(res);
+
+    free_image(dog);
+    free_image(fim);
+    free_image_u8(im);
+    free_image(gx);
+    free_image(sharpen);
+    free_image(box);
+}
+
+void test_gaussian_cache()
+{
+    // Sigmas 1 to 4 come from the built-in tables, 1.5 is built once on
+    // demand and 1.3 is off the grid, so it gets a fresh kernel each time.
+    float sigmas[6] = {1, 2, 3, 4, 1.5, 1.3};
+    int i;
+    for(i = 0; i < 6; ++i){
+        image g1 = make_1d_gaussian(sigmas[i]);
+        image g2 = make_gaussian_filter(sigmas[i]);
+        image c1 = gaussian_kernel(sigmas[i], 1);
+        image c2 = gaussian_kernel(sigmas[i], 0);
+        TEST(same_image(c1, g1));
+        TEST(same_image(c2, g2));
+        image d1 = gaussian_kernel(sigmas[i], 1);
+        image d2 = gaussian_kernel(sigmas[i], 0);
+        int shared = sigmas[i] != 1.3f;
+        TEST((d1.data == c1.data) == shared && (d2.data == c2.data) == shared);
+        release_gaussian_kernel(sigmas[i], c1);
+        release_gaussian_kernel(sigmas[i], c2);
+        release_gaussian_kernel(sigmas[i], d1);
+        release_gaussian_kernel(sigmas[i], d2);
+        free_image(g1);
+        free_image(g2);
+    }
+}
+
+void test_scale_space(){
+    image im = load_image("data/dog.jpg");
+    image low, high;
+    frequency_split(im, 2, &low, &high);
+    image low_freq = load_image("figs/low-frequency.png");
+    image high_freq = load_image("figs/high-frequency-clamp.png");
+    clamp_image(low);
+    clamp_image(high);
+    TEST(same_image(low, low_freq));
+    TEST(same_image(high, high_freq));
+    free_image(low);
+    free_image(high);
+    free_image(low_freq);
+    free_image(high_freq);
+
+    // Blurring level by level matches blurring the original at each sigma,
+    // away from the borders, where clamping does not compose. The last
+    // level is compared against the recursive Gaussian, hence the slack.
+    scale_space s = make_geometric_scale_space(im, 1, 1.6, 4);
+    int i, x, y, c;
+    for(i = 0; i < s.n; ++i){
+        image gt = smooth_image(im, s.sigmas[i]);
+        int m = (int)ceilf(3*s.sigmas[i]);
+        float err = 0;
+        for(c = 0; c < im.c; ++c){
+            for(y = m; y < im.h - m; ++y){
+                for(x = m; x < im.w - m; ++x){
+                    err = MAX(err, fabsf(get_pixel(s.levels[i], x, y, c) - get_pixel(gt, x, y, c)));
+                }
+            }
+        }
+        TEST(err < .01);
+        free_image(gt);
+    }
+    image dog = dog_image(s, 1);
+    image gt = sub_image(s.levels[2], s.levels[1]);
+    TEST(same_image(dog, gt));
+    free_image(dog);
+    free_image(gt);
+    free_scale_space(s);
+    free_image(im);
+}
+
+void test_unsharp_mask()
+{
+    image im = load_image("data/dog.jpg");
+    image blur = smooth_image(im, 2);
+    image detail = sub_image(im, blur);
+    scale_image(detail, 0, 1.5);
+    scale_image(detail, 1, 1.5);
+    scale_image(detail, 2, 1.5);
+    image gt = add_image(im, detail);
+    clamp_image(gt);
+    image sharp = unsharp_mask(im, 2, 1.5, 0);
+    TEST(same_image(sharp, gt));
+
+    // A threshold above any detail leaves the image untouched.
+    image same = unsharp_mask(im, 2, 1.5, 2);
+    TEST(same_image(same, im));
+
+    free_image(im);
+    free_image(blur);
+    free_image(detail);
+    free_image(gt);
+    free_image(sharp);
+    free_image(same);
+}
+
 void test_structure()
 {
     image im = load_image("data/dogbw.png");
@@ -442,6 +864,556 @@ void test_cornerness()
 }
 
 
+void test_harris_response()
+{
+    image im = load_image("data/dog.jpg");
+    image s = structure_matrix(im, 2);
+    image gt = cornerness_response(s);
+    image r = harris_response(im, 2);
+    float scale = 0;
+    int i;
+    for(i = 0; i < gt.w*gt.h; ++i) scale = MAX(scale, fabsf(gt.data[i]));
+    TEST(max_image_diff(r, gt) < 1e-4*scale);
+    image bw = load_image("data/dogbw.png");
+    image rbw = harris_response(bw, 2);
+    feature_normalize2(rbw);
+    image fig = load_image("figs/response.png");
+    TEST(same_image(rbw, fig));
+    free_image(im);
+    free_image(s);
+    free_image(gt);
+    free_image(r);
+    free_image(bw);
+    free_image(rbw);
+    free_image(fig);
+}
+
+void test_nms()
+{
+    image im = load_image("data/dogbw.png");
+    image r = harris_response(im, 2);
+    int w, x, y, i, j;
+    for(w = 1; w <= 9; w += 4){
+        image nms = nms_image(r, w);
+        int n, k = 0, ok = 1, cok = 1;
+        int *idx = nms_candidates(r, w, .0005, &n);
+        for(y = 0; y < r.h; ++y){
+            for(x = 0; x < r.w; ++x){
+                float v = get_pixel(r, x, y, 0);
+                int max = 1;
+                for(j = MAX(y-w, 0); j <= MIN(y+w, r.h-1); ++j){
+                    for(i = MAX(x-w, 0); i <= MIN(x+w, r.w-1); ++i){
+                        if(get_pixel(r, i, j, 0) > v) max = 0;
+                    }
+                }
+                if(get_pixel(nms, x, y, 0) != (max ? v : __FLT_MIN__)) ok = 0;
+                if(max && v > .0005){
+                    if(k >= n || idx[k] != y*r.w + x) cok = 0;
+                    ++k;
+                }
+            }
+        }
+        TEST(ok);
+        TEST(cok && k == n);
+        free_image(nms);
+        free(idx);
+    }
+    free_image(im);
+    free_image(r);
+}
+
+void test_describe_index()
+{
+    image im = load_image("data/dog.jpg");
+    int xs[] = {0, 1, 2, 100, im.w-3, im.w-2, im.w-1};
+    int ys[] = {0, 1, 2, 50, im.h-3, im.h-2, im.h-1};
+    int a, b, c, dx, dy, ok = 1;
+    for(a = 0; a < 7; ++a){
+        for(b = 0; b < 7; ++b){
+            descriptor d = describe_index(im, ys[b]*im.w + xs[a]);
+            int k = 0;
+            for(c = 0; c < im.c; ++c){
+                float v = get_pixel(im, xs[a], ys[b], c);
+                for(dx = -2; dx <= 2; ++dx){
+                    for(dy = -2; dy <= 2; ++dy){
+                        if(d.data[k++] != v - get_pixel(im, xs[a]+dx, ys[b]+dy, c)) ok = 0;
+                    }
+                }
+            }
+            if(d.n != k || d.p.x != xs[a] || d.p.y != ys[b]) ok = 0;
+            free(d.data);
+        }
+    }
+    TEST(ok);
+    free_image(im);
+}
+
+void test_tiled_harris()
+{
+    image im = load_image("data/dog.jpg");
+    image r = harris_response(im, 2);
+    int w, i;
+    for(w = 1; w <= 9; w += 4){
+        int n, m, ok = 1;
+        int *idx = nms_candidates(r, w, .0005, &n);
+        descriptor *d = harris_corner_detector(im, 2, .0005, w, &m);
+        for(i = 0; i < n && i < m; ++i){
+            descriptor e = describe_index(im, idx[i]);
+            if(d[i].p.x != e.p.x || d[i].p.y != e.p.y) ok = 0;
+            if(memcmp(d[i].data, e.data, e.n*sizeof(float))) ok = 0;
+            free(e.data);
+        }
+        TEST(ok && n == m);
+        free(idx);
+        free_descriptors(d, m);
+    }
+    free_image(im);
+    free_image(r);
+}
+
+void test_corner_selection()
+{
+    image im = load_image("data/dogbw.png");
+    image r = harris_response(im, 2);
+    int n, m, i, j, k = 50;
+    int *idx = nms_candidates(r, 3, .0005, &n);
+    assert(n > k);
+
+    // Top-k keeps the k strongest, strongest first.
+    int *top = top_k_corners(r, idx, n, k, &m);
+    float *resp = calloc(n, sizeof(float));
+    for(i = 0; i < n; ++i) resp[i] = r.data[idx[i]];
+    qsort(resp, n, sizeof(float), compare_floats);
+    int ok = m == k;
+    for(i = 0; i < m; ++i){
+        if(r.data[top[i]] != resp[n-1-i]) ok = 0;
+    }
+    TEST(ok);
+
+    // ANMS keeps corners whose suppression radius is among the k largest.
+    float *radius = calloc(n, sizeof(float));
+    for(i = 0; i < n; ++i){
+        radius[i] = FLT_MAX;
+        for(j = 0; j < n; ++j){
+            if(r.data[idx[i]] < .9*r.data[idx[j]]){
+                float dx = idx[i]%r.w - idx[j]%r.w, dy = idx[i]/r.w - idx[j]/r.w;
+                radius[i] = MIN(radius[i], dx*dx + dy*dy);
+            }
+        }
+    }
+    float *sorted = calloc(n, sizeof(float));
+    memcpy(sorted, radius, n*sizeof(float));
+    qsort(sorted, n, sizeof(float), compare_floats);
+    int *anms = anms_corners(r, idx, n, k, &m);
+    ok = m == k;
+    for(i = 0; i < m; ++i){
+        for(j = 0; j < n && idx[j] != anms[i]; ++j);
+        if(j == n || radius[j] < sorted[n-k]) ok = 0;
+    }
+    TEST(ok);
+
+    free(idx);
+    free(top);
+    free(anms);
+    free(resp);
+    free(radius);
+    free(sorted);
+    free_image(im);
+    free_image(r);
+}
+
+void test_grid_corners()
+{
+    image im = load_image("data/Rainier1.png");
+    image r = harris_response(im, 2);
+    int n, m, i, j, c, gx = 4, gy = 3, per = 5;
+    int *idx = nms_candidates(r, 3, 0, &n);
+    int *kept = grid_corners(r, idx, n, gx, gy, per, &m);
+
+    // Each cell keeps its strongest corners above 1% of its best.
+    float *resp = calloc(n, sizeof(float));
+    int ok = 1, k = 0;
+    for(c = 0; c < gx*gy; ++c){
+        int cn = 0;
+        for(i = 0; i < n; ++i){
+            int x = idx[i]%r.w, y = idx[i]/r.w;
+            if((y*gy/r.h)*gx + x*gx/r.w == c) resp[cn++] = r.data[idx[i]];
+        }
+        qsort(resp, cn, sizeof(float), compare_floats);
+        for(j = 0; j < per && j < cn && resp[cn-1-j] >= .01*resp[cn-1]; ++j, ++k){
+            if(k >= m || r.data[kept[k]] != resp[cn-1-j]) ok = 0;
+        }
+    }
+    TEST(ok && k == m);
+    free(kept);
+
+    int dn;
+    descriptor *d = harris_corner_detector_select(im, 2, 0, 3, CORNERS_GRID, 200, &dn);
+    TEST(dn > 100 && dn <= 200);
+    free_descriptors(d, dn);
+
+    // A long thin strip and small budgets still keep at most k corners.
+    image strip = make_image(1000, 10, 1);
+    for(i = 0; i < strip.w*strip.h; ++i) strip.data[i] = (rand()%256)/255.;
+    for(k = 0; k <= 8; k += 4){
+        d = harris_corner_detector_select(strip, 1, 0, 1, CORNERS_GRID, k, &dn);
+        TEST(dn <= k);
+        free_descriptors(d, dn);
+    }
+    free_image(strip);
+
+    free(resp);
+    free(idx);
+    free_image(r);
+    free_image(im);
+}
+
+void test_multiscale_harris()
+{
+    image im = load_image("data/dog.jpg");
+    int n, ns, i, j;
+
+    // One level is plain Harris.
+    descriptor *d = harris_corner_detector(im, 2, .001, 3, &n);
+    descriptor *ms = harris_multiscale_detector(im, 2, .001, 3, 1, 0, &ns);
+    int ok = n == ns;
+    for(i = 0; ok && i < n; ++i){
+        if(d[i].p.x != ms[i].p.x || d[i].p.y != ms[i].p.y || ms[i].scale != 1) ok = 0;
+    }
+    TEST(ok);
+    free_descriptors(ms, ns);
+
+    // Coarser corners never land inside the NMS window of a finer one.
+    ms = harris_multiscale_detector(im, 2, .001, 3, 3, 0, &ns);
+    ok = ns >= n;
+    for(i = 0; i < ns; ++i){
+        for(j = 0; j < ns; ++j){
+            float r = 3*ms[i].scale;
+            if(ms[j].scale < ms[i].scale && fabsf(ms[i].p.x - ms[j].p.x) <= r &&
+                    fabsf(ms[i].p.y - ms[j].p.y) <= r) ok = 0;
+        }
+    }
+    TEST(ok);
+    free_descriptors(ms, ns);
+
+    ms = harris_multiscale_detector(im, 2, .001, 3, 3, 1, &ns);
+    ok = ns > 0;
+    for(i = 0; i < ns; ++i) if(ms[i].scale != 4) ok = 0;
+    TEST(ok);
+    free_descriptors(ms, ns);
+
+    // Levels past a one-pixel image are ignored rather than overflowing.
+    int top = 1, nt;
+    for(i = MIN(im.w, im.h); i > 1; i = (i+1)/2) ++top;
+    descriptor *mt = harris_multiscale_detector(im, 2, .001, 3, top, 0, &nt);
+    ms = harris_multiscale_detector(im, 2, .001, 3, 40, 0, &ns);
+    ok = ns == nt;
+    for(i = 0; ok && i < ns; ++i){
+        if(ms[i].scale != mt[i].scale || ms[i].p.x != mt[i].p.x || ms[i].p.y != mt[i].p.y) ok = 0;
+    }
+    TEST(ok);
+    free_descriptors(ms, ns);
+    free_descriptors(mt, nt);
+
+    free_descriptors(d, n);
+    free_image(im);
+}
+
+void test_fast()
+{
+    image im = load_image("data/dog.jpg");
+    image gray = rgb_to_grayscale(im);
+    image_u8 g = image_to_u8(gray);
+    int cx[16] = {0, 1, 2, 3, 3, 3, 2, 1, 0, -1, -2, -3, -3, -3, -2, -1};
+    int cy[16] = {-3, -3, -2, -1, 0, 1, 2, 3, 3, 3, 2, 1, 0, -1, -2, -3};
+    int t = 20;
+    int arc, x, y, k, s, i;
+    for(arc = 9; arc <= 12; arc += 3){
+        image score = fast_response(im, arc, t/255.);
+        int ok = 1;
+        for(y = 3; y < im.h - 3; ++y){
+            for(x = 3; x < im.w - 3; ++x){
+                int v = g.data[y*g.w + x];
+                int corner = 0;
+                for(s = 0; s < 16; ++s){
+                    int b = 1, d = 1;
+                    for(k = 0; k < arc; ++k){
+                        int p = g.data[(y + cy[(s+k)%16])*g.w + x + cx[(s+k)%16]];
+                        if(!(p > v + t)) b = 0;
+                        if(!(p < v - t)) d = 0;
+                    }
+                    if(b || d) corner = 1;
+                }
+                if(corner != (get_pixel(score, x, y, 0) > 0)) ok = 0;
+            }
+        }
+        TEST(ok);
+        free_image(score);
+    }
+
+    // Non-max suppression over the candidates keeps the same corners as
+    // nms_candidates on the score map.
+    int n, m;
+    descriptor *d = fast_corner_detector(im, 9, t/255., 3, &n);
+    image score = fast_response(im, 9, t/255.);
+    int *idx = nms_candidates(score, 3, 0, &m);
+    int ok = n == m;
+    for(i = 0; ok && i < n; ++i){
+        if(d[i].p.x != idx[i] % im.w || d[i].p.y != idx[i] / im.w) ok = 0;
+    }
+    TEST(ok);
+    TEST(n > 0 && d[0].n == 25*im.c && d[0].scale == 1);
+    free(idx);
+    free_image(score);
+    free_descriptors(d, n);
+    free_image(im);
+    free_image(gray);
+    free_image_u8(g);
+}
+
+void test_descriptor_set()
+{
+    image im = load_image("data/dog.jpg");
+    int n, i, k;
+    descriptor *d = harris_corner_detector(im, 2, .001, 3, &n);
+    descriptor_set s = descriptors_to_set(d, n);
+    TEST(s.n == n && s.dim == d[0].n);
+    TEST(s.stride >= s.dim && s.stride % 8 == 0);
+    TEST(((size_t)s.data & 31) == 0);
+
+    int ok = 1;
+    for(i = 0; i < n; ++i){
+        float *row = s.data + i*s.stride;
+        if(s.p[i].x != d[i].p.x || s.p[i].y != d[i].p.y) ok = 0;
+        for(k = 0; k < s.dim; ++k) if(row[k] != d[i].data[k]) ok = 0;
+        for(k = s.dim; k < s.stride; ++k) if(row[k] != 0) ok = 0;
+    }
+    TEST(ok);
+
+    descriptor *back = set_to_descriptors(s);
+    ok = 1;
+    for(i = 0; i < n; ++i){
+        if(back[i].n != d[i].n || back[i].scale != d[i].scale) ok = 0;
+        if(memcmp(back[i].data, d[i].data, d[i].n*sizeof(float))) ok = 0;
+    }
+    TEST(ok);
+
+    free_descriptors(back, n);
+    free_descriptor_set(s);
+    free_descriptors(d, n);
+    free_image(im);
+}
+
+void test_nearest_two()
+{
+    image a = load_image("data/Rainier1.png");
+    image b = load_image("data/Rainier2.png");
+    int an, bn, i, j, k, mn;
+    descriptor *ad = harris_corner_detector(a, 2, .001, 3, &an);
+    descriptor *bd = harris_corner_detector(b, 2, .001, 3, &bn);
+    descriptor_set as = descriptors_to_set(ad, an);
+    descriptor_set bs = descriptors_to_set(bd, bn);
+    int *best = calloc(an, sizeof(int));
+    float *d1 = calloc(an, sizeof(float));
+    float *d2 = calloc(an, sizeof(float));
+    int metric;
+    for(metric = DISTANCE_L1; metric <= DISTANCE_L2; ++metric){
+        nearest_two(as, bs, metric, best, d1, d2);
+        int ok = 1;
+        for(j = 0; j < an; ++j){
+            float m1 = FLT_MAX, m2 = FLT_MAX, at_best = 0;
+            for(i = 0; i < bn; ++i){
+                float dis = 0;
+                if(metric == DISTANCE_L1){
+                    dis = l1_distance(ad[j].data, bd[i].data, ad[j].n);
+                } else {
+                    for(k = 0; k < ad[j].n; ++k){
+                        float d = ad[j].data[k] - bd[i].data[k];
+                        dis += d*d;
+                    }
+                    dis = sqrtf(dis);
+                }
+                if(i == best[j]) at_best = dis;
+                if(dis < m1){ m2 = m1; m1 = dis; }
+                else if(dis < m2) m2 = dis;
+            }
+            if(fabsf(d1[j] - m1) > 1e-4*(m1 + 1)) ok = 0;
+            if(fabsf(d2[j] - m2) > 1e-4*(m2 + 1)) ok = 0;
+            if(fabsf(at_best - m1) > 1e-4*(m1 + 1)) ok = 0;
+        }
+        TEST(ok);
+    }
+
+    nearest_two(as, bs, DISTANCE_L1, best, d1, d2);
+    match *m = match_descriptors(ad, an, bd, bn, &mn);
+    int ok = mn > 0;
+    for(i = 0; i < mn; ++i){
+        if(m[i].distance != d1[m[i].ai] || m[i].bi != best[m[i].ai]) ok = 0;
+        if(i && m[i].distance < m[i-1].distance) ok = 0;
+    }
+    TEST(ok);
+
+    int rn;
+    match *r = match_descriptor_sets(as, bs, DISTANCE_L2, .8, 0, &rn);
+    TEST(rn > 0 && rn < mn);
+    free(r);
+
+    // Few enough pairs are matched straight from the arrays, and agree
+    // with the blocked matcher.
+    descriptor_set sa = descriptors_to_set(ad, 8);
+    descriptor_set sb = descriptors_to_set(bd, 12);
+    match *small = match_descriptors(ad, 8, bd, 12, &mn);
+    r = match_descriptor_sets(sa, sb, DISTANCE_L1, 1, 0, &rn);
+    ok = mn == rn;
+    for(i = 0; ok && i < mn; ++i){
+        if(small[i].ai != r[i].ai || small[i].bi != r[i].bi) ok = 0;
+        if(fabsf(small[i].distance - r[i].distance) > 1e-4*(r[i].distance + 1)) ok = 0;
+    }
+    TEST(ok);
+    free(small);
+    free(r);
+    free_descriptor_set(sa);
+    free_descriptor_set(sb);
+
+    free(m);
+    free(best);
+    free(d1);
+    free(d2);
+    free_descriptor_set(as);
+    free_descriptor_set(bs);
+    free_descriptors(ad, an);
+    free_descriptors(bd, bn);
+    free_image(a);
+    free_image(b);
+}
+
+void test_kd_forest()
+{
+    image a = load_image("data/Rainier1.png");
+    image b = load_image("data/Rainier2.png");
+    int an, bn, j, mn;
+    descriptor *ad = harris_corner_detector(a, 2, .001, 3, &an);
+    descriptor *bd = harris_corner_detector(b, 2, .001, 3, &bn);
+    descriptor_set as = descriptors_to_set(ad, an);
+    descriptor_set bs = descriptors_to_set(bd, bn);
+    int *best = calloc(an, sizeof(int)), *kbest = calloc(an, sizeof(int));
+    float *d1 = calloc(an, sizeof(float)), *kd1 = calloc(an, sizeof(float));
+    float *d2 = calloc(an, sizeof(float)), *kd2 = calloc(an, sizeof(float));
+    nearest_two(as, bs, DISTANCE_L2, best, d1, d2);
+
+    // With checks covering the whole set the search is exact.
+    kd_forest *f = make_kd_forest(bs, 4, bn);
+    kd_nearest_two(f, as, DISTANCE_L2, kbest, kd1, kd2);
+    int ok = 1;
+    for(j = 0; j < an; ++j){
+        if(fabsf(kd1[j] - d1[j]) > 1e-4*(d1[j] + 1)) ok = 0;
+        if(fabsf(kd2[j] - d2[j]) > 1e-4*(d2[j] + 1)) ok = 0;
+    }
+    TEST(ok);
+    free_kd_forest(f);
+
+    // A small budget still finds most true nearest neighbours.
+    f = make_kd_forest(bs, 4, 64);
+    kd_nearest_two(f, as, DISTANCE_L2, kbest, kd1, kd2);
+    int found = 0;
+    for(j = 0; j < an; ++j) if(kbest[j] == best[j]) ++found;
+    TEST(found > .8*an);
+
+    // Matching through a forest built once over b.
+    match *m = match_descriptor_sets(as, bs, DISTANCE_L1, 1, f, &mn);
+    TEST(mn > .5*an);
+    free(m);
+    free_kd_forest(f);
+
+    // Budgets below one tree and one check are raised, not rejected.
+    f = make_kd_forest(bs, 0, -1);
+    kd_nearest_two(f, as, DISTANCE_L2, kbest, kd1, kd2);
+    ok = 1;
+    for(j = 0; j < an; ++j) if(kbest[j] < 0 || kbest[j] >= bn || !(kd1[j] >= d1[j] - 1e-4)) ok = 0;
+    TEST(ok);
+    free_kd_forest(f);
+
+    free(best); free(kbest);
+    free(d1); free(kd1);
+    free(d2); free(kd2);
+    free_descriptor_set(as);
+    free_descriptor_set(bs);
+    free_descriptors(ad, an);
+    free_descriptors(bd, bn);
+    free_image(a);
+    free_image(b);
+}
+
+void test_brief()
+{
+    image im = load_image("data/dog.jpg");
+    int dx = 7, dy = 5, x, y, c, i, k;
+    image shifted = make_image(im.w, im.h, im.c);
+    for(c = 0; c < im.c; ++c){
+        for(y = 0; y < im.h; ++y){
+            for(x = 0; x < im.w; ++x){
+                set_pixel(shifted, x, y, c, get_pixel(im, x - dx, y - dy, c));
+            }
+        }
+    }
+
+    int an, bn, mn;
+    descriptor *ad = harris_corner_detector(im, 2, .001, 3, &an);
+    descriptor *bd = harris_corner_detector(shifted, 2, .001, 3, &bn);
+    binary_descriptor *a = brief_descriptors(im, ad, an);
+    binary_descriptor *b = brief_descriptors(shifted, bd, bn);
+    TEST(hamming_distance(a, a) == 0);
+
+    int ok = 1;
+    for(i = 0; i < an && i < bn; ++i){
+        int bits = 0;
+        for(k = 0; k < 256; ++k){
+            bits += ((a[i].bits[k/64] ^ b[i].bits[k/64]) >> (k%64)) & 1;
+        }
+        if(bits != hamming_distance(&a[i], &b[i])) ok = 0;
+    }
+    TEST(ok);
+
+    match *m = match_binary_descriptors(a, an, b, bn, &mn);
+    int right = 0;
+    ok = 1;
+    for(i = 0; i < mn; ++i){
+        if(m[i].distance != hamming_distance(&a[m[i].ai], &b[m[i].bi])) ok = 0;
+        if(i && m[i].distance < m[i-1].distance) ok = 0;
+        if(m[i].q.x == m[i].p.x + dx && m[i].q.y == m[i].p.y + dy) ++right;
+    }
+    TEST(ok);
+    TEST(mn > 0 && right > .8*mn);
+
+    // A corner described at scale 2 reads the same as the same corner at
+    // scale 1 in the half-size image, since smoothing scales too.
+    image half = bilinear_resize(im, im.w/2, im.h/2);
+    descriptor *hd = calloc(an, sizeof(descriptor));
+    for(i = 0; i < an; ++i){
+        ad[i].scale = 2;
+        hd[i] = ad[i];
+        hd[i].p.x /= 2;
+        hd[i].p.y /= 2;
+        hd[i].scale = 1;
+    }
+    binary_descriptor *a2 = brief_descriptors(im, ad, an);
+    binary_descriptor *h1 = brief_descriptors(half, hd, an);
+    int bits = 0;
+    for(i = 0; i < an; ++i) bits += hamming_distance(&a2[i], &h1[i]);
+    TEST(an > 0 && bits < 20*an);
+    free(a2);
+    free(h1);
+    free(hd);
+    free_image(half);
+
+    free(m);
+    free(a);
+    free(b);
+    free_descriptors(ad, an);
+    free_descriptors(bd, bn);
+    free_image(im);
+    free_image(shifted);
+}
 
 void test_projection()
 {
@@ -499,6 +1471,34 @@ void test_compute_homography()
     free_matrix(Hp);
 }
 
+void test_box_filter()
+{
+    image im = load_image("data/dog.jpg");
+    int s, x, y, c, i, j;
+    for(s = 5; s <= 6; ++s){
+        // The window the integral-image version summed, 2*((s-1)/2)+1
+        // pixels wide with zeros outside, divided by s*s.
+        image box = box_filter_image(im, s);
+        int p = (s-1)/2, ok = 1;
+        for(c = 0; c < im.c; ++c){
+            for(y = 0; y < im.h; y += 7){
+                for(x = 0; x < im.w; x += 3){
+                    float v = 0;
+                    for(j = y-p; j <= y+p; ++j){
+                        for(i = x-p; i <= x+p; ++i){
+                            if(i >= 0 && j >= 0 && i < im.w && j < im.h) v += get_pixel(im, i, j, c);
+                        }
+                    }
+                    if(fabsf(v/(s*s) - get_pixel(box, x, y, c)) > 1e-4) ok = 0;
+                }
+            }
+        }
+        TEST(ok);
+        free_image(box);
+    }
+    free_image(im);
+}
+
 void test_activate_matrix()
 {
     matrix a = load_matrix("data/test/a.matrix");
@@ -690,25 +1690,51 @@ void test_hw2()
 {
     test_gaussian_filter();
     test_sharpen_filter();
+    test_unsharp_mask();
     test_emboss_filter();
     test_highpass_filter();
     test_convolution();
     test_gaussian_blur();
+    test_gaussian_cache();
+    test_box_blur();
     test_hybrid_image();
     test_frequency_image();
+    test_scale_space();
+    test_fft_convolution();
+    test_convolution_border();
     test_sobel();
+    test_sobel_gradients();
+    test_named_filters();
+    test_filter_bank();
+    test_median_filter();
+    test_bilateral_filter();
+    test_u8_convolution();
     printf("%d tests, %d passed, %d failed\n", tests_total, tests_total-tests_fail, tests_fail);
 }
 void test_hw3()
 {
+    test_smooth_methods();
     test_structure();
     test_cornerness();
+    test_harris_response();
+    test_nms();
+    test_describe_index();
+    test_tiled_harris();
+    test_corner_selection();
+    test_grid_corners();
+    test_multiscale_harris();
+    test_fast();
+    test_descriptor_set();
+    test_nearest_two();
+    test_kd_forest();
+    test_brief();
     test_projection();
     test_compute_homography();
     printf("%d tests, %d passed, %d failed\n", tests_total, tests_total-tests_fail, tests_fail);
 }
 void test_hw4()
 {
+    test_box_filter();
     printf("%d tests, %d passed, %d failed\n", tests_total, tests_total-tests_fail, tests_fail);
 }
 void test_hw5()
@@ -27,7 +27,8 @@ class POINT(Structure):
 class DESCRIPTOR(Structure):
     _fields_ = [("p", POINT),
                 ("n", c_int),
-                ("data", POINTER(c_float))]
+                ("data", POINTER(c_float)),
+                ("scale", c_float)]
 
 class MATRIX(Structure):
     _fields_ = [("rows", c_int),
@@ -179,10 +180,18 @@ convolve_image = lib.convolve_image
 convolve_image.argtypes = [IMAGE, IMAGE, c_int]
 convolve_image.restype = IMAGE
 
+fft_convolve_image = lib.fft_convolve_image
+fft_convolve_image.argtypes = [IMAGE, IMAGE, c_int]
+fft_convolve_image.restype = IMAGE
+
 harris_corner_detector = lib.harris_corner_detector
 harris_corner_detector.argtypes = [IMAGE, c_float, c_float, c_int, POINTER(c_int)]
 harris_corner_detector.restype = POINTER(DESCRIPTOR)
 
+harris_multiscale_detector = lib.harris_multiscale_detector
+harris_multiscale_detector.argtypes = [IMAGE, c_float, c_float, c_int, c_int, c_int, POINTER(c_int)]
+harris_multiscale_detector.restype = POINTER(DESCRIPTOR)
+
 mark_corners = lib.mark_corners
 mark_corners.argtypes = [IMAGE, POINTER(DESCRIPTOR), c_int]
 mark_corners.restype = None